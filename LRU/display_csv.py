@@ -5,6 +5,13 @@ import matplotlib.pyplot as plt
 from mpl_toolkits.mplot3d import Axes3D
 
 df = pd.read_csv("./out.csv", sep=";")
+df = df[
+    (df["workload"] == "uniform")
+    & (df["recency"] == "heap")
+    & (df["index"] == "unordered_map")
+    & (df["admission"] == "none")
+    & (df["expiry"] == "none")
+]
 
 
 fig = plt.figure()
@@ -1,25 +1,58 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <cmath>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <functional>
+#include <immintrin.h>
 #include <limits>
+#include <linux/futex.h>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <shared_mutex>
 #include <span>
+#include <stdexcept>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <type_traits>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include "../bench.h"
 
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// Moving such an object to another address and forgetting the old one is a
+// memcpy. A type that isn't trivially copyable can opt in by declaring a
+// `static constexpr bool trivially_relocatable`
+template <class T> constexpr bool is_trivially_relocatable() {
+  if constexpr (requires { T::trivially_relocatable; }) {
+    return T::trivially_relocatable;
+  } else {
+    return std::is_trivially_copyable_v<T>;
+  }
+}
 
-// A non resizable vector
-// Use it as an array, but malloced
+// A vector with cache line aligned storage
+// It doubles when full, unless T can't be moved at all (then it asserts)
+// Arrays of 2MiB and more are mmaped on huge page boundaries, and grown with
+// mremap when T is trivially relocatable: the pages are moved, not copied
 template <class T> class dyn_array {
   size_t _size;
   size_t _capacity;
@@ -32,8 +65,82 @@ template <class T> class dyn_array {
     ~T_opt(){};
   };
   T_opt *_data;
+  // Non zero when _data is a file mapping of its own (a reopened snapshot)
+  size_t _file_bytes = 0;
+
+  // Cache line aligned, so that the heaps can lay out their nodes on lines
+  static constexpr std::align_val_t ALIGNMENT{MAX(alignof(T_opt), size_t(64))};
+  static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+  static constexpr bool GROWABLE =
+      is_trivially_relocatable<T>() || std::is_nothrow_move_constructible_v<T>;
+
+  static bool is_mapped(size_t cap) {
+    return cap * sizeof(T_opt) >= HUGE_PAGE_SIZE;
+  }
+  static size_t mapped_bytes(size_t cap) {
+    return (cap * sizeof(T_opt) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  }
+
+  // Over reserves by a huge page and trims both ends to get the alignment
+  static void *map_aligned(size_t bytes) {
+    void *p = mmap(nullptr, bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    uintptr_t begin = uintptr_t(p);
+    uintptr_t aligned = (begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (aligned != begin) {
+      munmap(p, aligned - begin);
+    }
+    munmap((void *)(aligned + bytes), begin + HUGE_PAGE_SIZE - aligned);
+    madvise((void *)aligned, bytes, MADV_HUGEPAGE);
+    return (void *)aligned;
+  }
+
+  static T_opt *allocate(size_t cap) {
+    if (is_mapped(cap)) {
+      return (T_opt *)map_aligned(mapped_bytes(cap));
+    }
+    return (T_opt *)::operator new(cap * sizeof(T_opt), ALIGNMENT);
+  }
+
+  static void deallocate(T_opt *data, size_t cap) {
+    if (is_mapped(cap)) {
+      munmap(data, mapped_bytes(cap));
+    } else {
+      ::operator delete(data, ALIGNMENT);
+    }
+  }
+
+  // Tries to extend the mapping where it is, then moves its pages to a fresh
+  // aligned range
+  T_opt *remap(size_t cap) {
+    size_t old_bytes = mapped_bytes(_capacity);
+    size_t new_bytes = mapped_bytes(cap);
+    if (old_bytes == new_bytes) {
+      return _data;
+    }
+    void *p = mremap(_data, old_bytes, new_bytes, 0);
+    if (p != MAP_FAILED) {
+      return (T_opt *)p;
+    }
+    void *dst = map_aligned(new_bytes);
+    p = mremap(_data, old_bytes, new_bytes, MREMAP_MAYMOVE | MREMAP_FIXED, dst);
+    if (p == MAP_FAILED) {
+      munmap(dst, new_bytes);
+      throw std::bad_alloc();
+    }
+    return (T_opt *)p;
+  }
+
+  [[gnu::cold, gnu::noinline]] void grow() {
+    reserve(MAX(2 * _capacity, size_t(4)));
+  }
 
 public:
+  using value_type = T;
+
   dyn_array(const dyn_array &) = delete;
   dyn_array &operator=(const dyn_array &) = delete;
 
@@ -45,15 +152,61 @@ public:
     if (&other == this) {
       return *this;
     }
-    delete[] _data;
+    release();
     _size = std::exchange(other._size, 0);
     _capacity = std::exchange(other._capacity, 0);
     _data = std::exchange(other._data, nullptr);
+    _file_bytes = std::exchange(other._file_bytes, 0);
     return *this;
   };
 
   dyn_array(const size_t cap) : _capacity(cap), _size(0) {
-    _data = new T_opt[cap]();
+    _data = allocate(cap);
+  }
+
+  // Takes over a private file mapping of file_bytes bytes holding size items,
+  // with room for cap. It is unmapped on destruction, copied out on growth
+  static dyn_array adopt(void *mapping, size_t file_bytes, size_t size,
+                         size_t cap) {
+    static_assert(is_trivially_relocatable<T>());
+    assert(cap * sizeof(T_opt) <= file_bytes && size <= cap);
+    dyn_array a(0);
+    a.release();
+    a._data = (T_opt *)mapping;
+    a._size = size;
+    a._capacity = cap;
+    a._file_bytes = file_bytes;
+    return a;
+  }
+
+  // Indices stay valid, pointers and references don't
+  void reserve(size_t cap)
+    requires GROWABLE
+  {
+    if (cap <= _capacity) {
+      return;
+    }
+
+    T_opt *data;
+    if (is_trivially_relocatable<T>() && is_mapped(_capacity) &&
+        _file_bytes == 0) {
+      data = remap(cap);
+    } else {
+      data = allocate(cap);
+      if constexpr (is_trivially_relocatable<T>()) {
+        if (_size > 0) {
+          memcpy((void *)data, (void *)_data, _size * sizeof(T_opt));
+        }
+      } else {
+        for (size_t i = 0; i < _size; i++) {
+          new (&data[i].t) T(std::move(_data[i].t));
+          _data[i].t.~T();
+        }
+      }
+      deallocate();
+    }
+    _data = data;
+    _capacity = cap;
   }
 
   T *data() { return &_data->t; }
@@ -63,13 +216,26 @@ public:
   const T *begin() const { return data(); }
   const T *end() const { return data() + size(); }
 
-  void push(T t) {
-    assert(_size != _capacity);
-    _data[_size].t = t;
-    _size++;
-  }
+  void push(const T &t) { emplace(t); }
+  void push(T &&t) { emplace(std::move(t)); }
 
+  // When full, the item is built before growing: args may point in the array
   template <class... Args> void emplace(Args &&...args) {
+    if constexpr (GROWABLE) {
+      if (_size == _capacity) [[unlikely]] {
+        T_opt tmp;
+        new (&tmp.t) T(std::forward<Args>(args)...);
+        grow();
+        if constexpr (is_trivially_relocatable<T>()) {
+          memcpy((void *)&_data[_size], (void *)&tmp, sizeof(T_opt));
+        } else {
+          new (&_data[_size].t) T(std::move(tmp.t));
+          tmp.t.~T();
+        }
+        _size++;
+        return;
+      }
+    }
     assert(_size != _capacity);
     new (&_data[_size].t) T(std::forward<Args>(args)...);
     _size++;
@@ -95,14 +261,27 @@ public:
     return _data[index].t;
   }
 
-  ~dyn_array() {
+  ~dyn_array() { release(); }
+
+private:
+  void release() {
     // TODO: if not trivially destructible
     for (size_t i = 0; i < _size; i++) {
       _data[i].t.~T();
     }
 
-    // if moved, data is nullptr that can be deleted
-    delete[] _data;
+    // if moved, data is nullptr
+    if (_data) {
+      deallocate();
+    }
+  }
+
+  void deallocate() {
+    if (_file_bytes > 0) {
+      munmap(_data, std::exchange(_file_bytes, 0));
+    } else {
+      deallocate(_data, _capacity);
+    }
   }
 };
 
@@ -122,8 +301,19 @@ template <class T> class stable_dyn_array {
       T t;
       size_t next_free;
     };
+    static constexpr bool trivially_relocatable =
+        is_trivially_relocatable<T>();
     template <class... Args>
     I(Args &&...args) : occupied(true), t(std::forward<Args>(args)...) {}
+    // Used when the array grows
+    I(I &&other) noexcept(std::is_nothrow_move_constructible_v<T>)
+        : occupied(other.occupied) {
+      if (occupied) {
+        new (&t) T(std::move(other.t));
+      } else {
+        next_free = other.next_free;
+      }
+    }
     ~I() {
       if (occupied) {
         t.~T();
@@ -139,6 +329,13 @@ template <class T> class stable_dyn_array {
 
 public:
   stable_dyn_array(size_t size) : items(size) {}
+  // Handles are indices, they stay valid
+  void reserve(size_t size) { items.reserve(size); }
+
+  template <class Archive> void persist(Archive &ar) {
+    ar(items);
+    ar(next_free);
+  }
   template <class... Args> size_t emplace(Args &&...args) {
     if (next_free != NO_MORE_ITEM_IN_FREE_LIST) {
       size_t index = next_free;
@@ -200,6 +397,18 @@ public:
   heap(size_t size, Cmp cmp) : ts(size), inner_heap(size), _cmp(cmp) {}
   heap(size_t size) : heap(size, {}) {}
 
+  // Bulk load in O(n), the items are moved from
+  // The heap is fresh, the handle of items[i] is {i}
+  heap(std::span<T> items, size_t size, Cmp cmp) : heap(size, cmp) {
+    assert(items.size() <= size);
+    for (auto &t : items) {
+      push_unordered(std::move(t));
+    }
+    heapify();
+  }
+  heap(std::span<T> items, size_t size) : heap(items, size, {}) {}
+  heap(std::span<T> items) : heap(items, items.size(), {}) {}
+
   T &minimum() {
     assert(inner_heap.size() > 0);
     return ts[inner_heap[0]].t;
@@ -210,15 +419,47 @@ public:
   }
 
   heap_handle insert(T &&t) {
-    assert(inner_heap.size() < inner_heap.capacity());
     size_t idx = ts.emplace(inner_heap.size(), std::move(t));
     inner_heap.push(idx);
     siftup(size());
 
     return {idx};
   }
+
+  // Inserts all the items (they are moved from), handles[i] is the handle of
+  // items[i]
+  // When the batch is at least as large as the heap, everything is heapified
+  // bottom up in O(n + k) rather than sifted up one by one in O(k log(n + k))
+  void insert_bulk(std::span<T> items, std::span<heap_handle> handles) {
+    assert(items.size() == handles.size());
+    reserve(size() + items.size());
+    size_t old_size = size();
+    for (size_t i = 0; i < items.size(); i++) {
+      handles[i] = {push_unordered(std::move(items[i]))};
+    }
+
+    if (items.size() >= old_size) {
+      heapify();
+    } else {
+      for (size_t i = old_size + 1; i <= size(); i++) {
+        siftup(i);
+      }
+    }
+  }
+
   size_t size() const { return inner_heap.size(); }
   size_t capacity() const { return inner_heap.capacity(); }
+  // Inserts grow the heap anyway, this only saves the intermediate copies
+  // Handles stay valid, references to the items don't
+  void reserve(size_t size) {
+    ts.reserve(size);
+    inner_heap.reserve(size);
+  }
+
+  template <class Archive> void persist(Archive &ar) {
+    ar(ts);
+    ar(inner_heap);
+  }
 
   void remove_minimum() {
     assert(inner_heap.size() > 0);
@@ -228,7 +469,23 @@ public:
     ts.remove(item_idx);
     inner_heap.pop();
 
-    siftdown(1);
+    if (size() > 0) {
+      siftdown(1);
+    }
+    ASSERT_HEAP_COSTLY(is_heap(1, size()));
+  }
+
+  // The last item fills the hole, and goes whichever way it has to
+  void remove(heap_handle handle) {
+    size_t i = ts[handle.handle].heap_index + 1;
+    swap(i, size());
+
+    ts.remove(handle.handle);
+    inner_heap.pop();
+
+    if (i <= size()) {
+      siftup(siftdown(i));
+    }
     ASSERT_HEAP_COSTLY(is_heap(1, size()));
   }
 
@@ -242,6 +499,21 @@ public:
   const T &operator[](heap_handle handle) const { return ts[handle.handle].t; }
 
 private:
+  // Appends without restoring the heap invariant
+  size_t push_unordered(T &&t) {
+    size_t idx = ts.emplace(inner_heap.size(), std::move(t));
+    inner_heap.push(idx);
+    return idx;
+  }
+
+  // Floyd: sift down every inner node, from the last one up to the root
+  void heapify() {
+    for (size_t i = size() / 2; i >= 1; i--) {
+      siftdown(i);
+    }
+    ASSERT_HEAP_COSTLY(is_heap(1, size()));
+  }
+
   void swap(size_t i, size_t j) {
     ASSERT_HEAP_COSTLY(handles_are_valid());
 
@@ -263,41 +535,51 @@ private:
     return _cmp(ts[inner_heap[i - 1]].t, ts[inner_heap[j - 1]].t);
   }
 
+  // Moves the item at j to the hole at i
+  void move(size_t i, size_t j) {
+    inner_heap[i - 1] = inner_heap[j - 1];
+    ts[inner_heap[i - 1]].heap_index = i - 1;
+  }
+  void place(size_t i, size_t item_idx) {
+    inner_heap[i - 1] = item_idx;
+    ts[item_idx].heap_index = i - 1;
+  }
+
   // NOTE: INDEXED FROM 1 IN THOSE FUNCTION
+  // Both sifts carry the item in a hole instead of swapping at every level
   size_t siftup(size_t i) {
     ASSERT_HEAP_COSTLY(is_heap(1, i - 1));
 
-    size_t parent_index = i / 2;
-
-    if (i == 1 || cmp(parent_index, i)) {
-      return i;
+    size_t item_idx = inner_heap[i - 1];
+    while (i > 1 && !_cmp(ts[inner_heap[i / 2 - 1]].t, ts[item_idx].t)) {
+      move(i, i / 2);
+      i /= 2;
     }
-    swap(parent_index, i);
-    return siftup(parent_index);
+    place(i, item_idx);
+    return i;
   }
 
-  // Sift down is not optimal an should be improved
   size_t siftdown(size_t i) {
     ASSERT_HEAP_COSTLY(is_heap(2 * i, inner_heap.size()));
     ASSERT_HEAP_COSTLY(is_heap(2 * i + 1, inner_heap.size()));
 
-    if (2 * i > inner_heap.size()) {
-      return i;
-    }
-
-    size_t m = 2 * i + 1;
-    if (2 * i + 1 > inner_heap.size() || cmp(2 * i, 2 * i + 1)) {
-      m = 2 * i;
-    }
-    size_t new_i = i;
-    if (!cmp(i, m)) {
-      swap(i, m);
-      siftdown(m);
-      new_i = m;
+    size_t item_idx = inner_heap[i - 1];
+    size_t n = inner_heap.size();
+    while (2 * i <= n) {
+      size_t m = 2 * i;
+      if (m + 1 <= n && !cmp(m, m + 1)) {
+        m = m + 1;
+      }
+      if (_cmp(ts[item_idx].t, ts[inner_heap[m - 1]].t)) {
+        break;
+      }
+      move(i, m);
+      i = m;
     }
+    place(i, item_idx);
 
     ASSERT_HEAP_COSTLY(is_heap(i, inner_heap.size()));
-    return new_i;
+    return i;
   }
 
   bool is_heap(size_t root, size_t upto) const {
@@ -315,199 +597,2683 @@ private:
   }
 };
 
-template <class K, class V> class LRU {
+// A d-ary heap that keeps the items themselves in the ordering array, so that
+// comparisons never go through an indirection
+// The children of i are D * i + 1 .. D * i + D; the array starts with D - 1
+// padding items so that they start on a multiple of D: with D * sizeof(T) = 64
+// they share a cache line
+// The handles of the items sit in a parallel array, only touched on moves,
+// and point to their position in a stable_dyn_array
+// T must be default constructible, for the padding
+template <class T, size_t D = 4, class Cmp = std::less_equal<T>>
+class dary_heap {
 public:
-  struct I {
-    size_t t;
-    K k;
-    V v;
-    friend bool operator<=(const I &a, const I &b) { return a.t >= b.t; }
+  struct heap_handle {
+    size_t handle;
   };
-  heap<I> h;
-  using handle_t = heap<I>::heap_handle;
-  std::unordered_map<K, handle_t> key2handle;
-  size_t time = 0;
 
-  LRU(size_t size) : h(size) { key2handle.reserve(4 * size); }
+private:
+  static constexpr size_t PAD = D - 1;
 
-  std::optional<std::reference_wrapper<V>> find(K k) {
-    auto it = key2handle.find(k);
-    if (it != key2handle.end()) {
-      handle_t handle = it->second;
-      h.update(handle, [this](I &i) { i.t = time++; });
-      return h[handle].v;
+  dyn_array<T> ts;
+  dyn_array<size_t> handles;
+  stable_dyn_array<size_t> positions;
+  Cmp _cmp;
+
+public:
+  dary_heap(size_t size, Cmp cmp)
+      : ts(size + PAD), handles(size + PAD), positions(size), _cmp(cmp) {
+    for (size_t i = 0; i < PAD; i++) {
+      ts.emplace();
+      handles.push(0);
     }
-    return {};
   }
+  dary_heap(size_t size) : dary_heap(size, {}) {}
+
+  // Bulk load in O(n), the items are moved from
+  // The heap is fresh, the handle of items[i] is {i}
+  dary_heap(std::span<T> items, size_t size, Cmp cmp) : dary_heap(size, cmp) {
+    assert(items.size() <= size);
+    for (auto &t : items) {
+      push_unordered(std::move(t));
+    }
+    heapify();
+  }
+  dary_heap(std::span<T> items, size_t size) : dary_heap(items, size, {}) {}
+  dary_heap(std::span<T> items) : dary_heap(items, items.size(), {}) {}
 
-  V &insert(K k, V v) {
-    handle_t handle;
+  T &minimum() {
+    assert(size() > 0);
+    return ts[PAD];
+  }
+  heap_handle minimum_handle() {
+    assert(size() > 0);
+    return {handles[PAD]};
+  }
 
-    I new_i{time++, k, v};
-    if (h.size() == h.capacity()) {
-      key2handle.erase(h.minimum().k);
+  heap_handle insert(T &&t) {
+    size_t handle = positions.emplace(size());
+    ts.emplace(std::move(t));
+    handles.push(handle);
+    siftup(size() - 1);
+
+    return {handle};
+  }
+
+  // Same as heap::insert_bulk
+  void insert_bulk(std::span<T> items, std::span<heap_handle> handles) {
+    assert(items.size() == handles.size());
+    reserve(size() + items.size());
+    size_t old_size = size();
+    for (size_t i = 0; i < items.size(); i++) {
+      handles[i] = {push_unordered(std::move(items[i]))};
+    }
 
-      handle = h.minimum_handle();
-      h.update(handle, [&new_i](I &i) { i = std::move(new_i); });
+    if (items.size() >= old_size) {
+      heapify();
     } else {
-      handle = h.insert(std::move(new_i));
+      for (size_t i = old_size; i < size(); i++) {
+        siftup(i);
+      }
     }
-    key2handle.emplace(k, handle);
-    return h[handle].v;
   }
 
-  V &find_or_insert(K k, auto Fn) {
-    auto a = find(k);
-    if (a) {
-      return a.value();
-    };
-    auto v = Fn();
-    return insert(k, v);
+  size_t size() const { return ts.size() - PAD; }
+  size_t capacity() const { return ts.capacity() - PAD; }
+  // Same as heap::reserve
+  void reserve(size_t size) {
+    ts.reserve(size + PAD);
+    handles.reserve(size + PAD);
+    positions.reserve(size);
+  }
+
+  template <class Archive> void persist(Archive &ar) {
+    ar(ts);
+    ar(handles);
+    ar(positions);
   }
-};
 
-template class LRU<int, std::string>;
+  void remove_minimum() {
+    assert(size() > 0);
+    positions.remove(handles[PAD]);
+    if (size() > 1) {
+      move(0, size() - 1);
+    }
+    ts.pop();
+    handles.pop();
 
-void test_heap() {
-  heap<size_t> s(5);
-  s.insert(1);
-  s.insert(3);
-  s.insert(2);
-  s.insert(0);
-  assert(s.size() == 4);
-  assert(s.minimum() == 0);
-  s.remove_minimum();
-  assert(s.size() == 3);
-  assert(s.minimum() == 1);
-  s.remove_minimum();
-  assert(s.size() == 2);
-  assert(s.minimum() == 2);
-  s.remove_minimum();
-  assert(s.size() == 1);
-  assert(s.minimum() == 3);
-  s.remove_minimum();
-  assert(s.size() == 0);
+    if (size() > 0) {
+      siftdown(0);
+    }
+    ASSERT_HEAP_COSTLY(is_heap());
+  }
 
-  struct NewType {
-    size_t i;
-    size_t v;
-  };
+  void remove(heap_handle handle) {
+    size_t i = positions[handle.handle];
+    positions.remove(handle.handle);
+    if (i != size() - 1) {
+      move(i, size() - 1);
+    }
+    ts.pop();
+    handles.pop();
 
-  auto cmp = [](const NewType &a, const NewType &b) { return a.i < b.i; };
-  heap<NewType, decltype(cmp)> s2(2, cmp);
-  s2.insert(NewType{1, 1});
-  auto h = s2.insert(NewType{0, 2});
-  s2.update(h, [](NewType &n) {
-    assert(n.i == 0);
-    assert(n.v == 2);
-    n.i = 3;
-  });
-  assert(s2.size() == 2);
-  assert(s2.minimum().i == 1);
-  assert(s2.minimum().v == 1);
-  s2.remove_minimum();
-  assert(s2.size() == 1);
-  assert(s2.minimum().i == 3);
-  assert(s2.minimum().v == 2);
-  s2.remove_minimum();
-  assert(s2.size() == 0);
+    if (i < size()) {
+      siftdown(siftup(i));
+    }
+    ASSERT_HEAP_COSTLY(is_heap());
+  }
 
-  printf("Heap seems to work!\n");
-}
+  // Items move in the heap: a reference to an item is only valid until the
+  // next operation
+  void update(heap_handle handle, auto Fn) {
+    size_t i = positions[handle.handle];
+    Fn(ts[PAD + i]);
 
-void test_lru() {
-  LRU<int, std::string> lru(2);
-  {
-    auto &v = lru.find_or_insert(0, []() { return "1234"; });
-    assert(v == "1234");
+    siftdown(siftup(i));
   }
-  {
-    auto &v = lru.find_or_insert(0, []() {
-      assert(false);
-      return "";
-    });
-    assert(v == "1234");
+  T &operator[](heap_handle handle) {
+    return ts[PAD + positions[handle.handle]];
   }
-
-  {
-    bool did_insert = false;
-    auto &v = lru.find_or_insert(1, [&did_insert]() {
-      did_insert = true;
-      return "pi";
-    });
-    assert(did_insert);
-    assert(v == "pi");
+  const T &operator[](heap_handle handle) const {
+    return ts[PAD + positions[handle.handle]];
   }
-  {
-    auto &v = lru.find_or_insert(1, []() {
-      assert(false);
-      return "";
+
+  // Calls Fn(item, rank) on every item, rank being its place in the order
+  // (0 for the minimum): Fn must keep the order, so nothing moves
+  void renumber(auto Fn) {
+    std::vector<size_t> order(size());
+    for (size_t i = 0; i < order.size(); i++) {
+      order[i] = PAD + i;
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+      return !_cmp(ts[b], ts[a]);
     });
-    assert(v == "pi");
+    for (size_t r = 0; r < order.size(); r++) {
+      Fn(ts[order[r]], r);
+    }
+    ASSERT_HEAP_COSTLY(is_heap());
   }
 
-  lru.find_or_insert(0, []() { return "213"; });
-  lru.find_or_insert(2, []() { return "213"; });
-  lru.find_or_insert(1, []() {
-    assert(false);
-    return "213";
-  });
-  {
-    bool did_insert = false;
-    lru.find_or_insert(0, [&did_insert]() {
-      did_insert = true;
-      return "213";
-    });
-    assert(did_insert);
+private:
+  size_t push_unordered(T &&t) {
+    size_t handle = positions.emplace(size());
+    ts.emplace(std::move(t));
+    handles.push(handle);
+    return handle;
   }
-  printf("LRU seems to work!\n");
-}
 
-void blackbox(auto &r) { __asm__ volatile("" : "+g"(r) : :); }
+  void heapify() {
+    if (size() < 2) {
+      return;
+    }
+    // (size() - 2) / D is the parent of the last item
+    for (size_t i = (size() - 2) / D + 1; i-- > 0;) {
+      siftdown(i);
+    }
+    ASSERT_HEAP_COSTLY(is_heap());
+  }
 
-int do_bench(LRU<unsigned int, unsigned int> &lru,
-             std::span<unsigned int> data) {
-  int misses = 0;
-  for (size_t i = 0; i < data.size(); i++) {
-    auto k = data[i];
+  // Moves the item at j to the hole at i
+  void move(size_t i, size_t j) {
+    ts[PAD + i] = std::move(ts[PAD + j]);
+    handles[PAD + i] = handles[PAD + j];
+    positions[handles[PAD + i]] = i;
+  }
+  void place(size_t i, T &&t, size_t handle) {
+    ts[PAD + i] = std::move(t);
+    handles[PAD + i] = handle;
+    positions[handle] = i;
+  }
 
-    auto u = lru.find(k);
-    int v;
-    if (u) {
-      v = u.value();
-    } else {
-      misses += 1;
-      v = lru.insert(k, 0);
+  // NOTE: INDEXED FROM 0, WITHOUT THE PADDING
+  size_t siftup(size_t i) {
+    T t = std::move(ts[PAD + i]);
+    size_t handle = handles[PAD + i];
+    while (i > 0 && !_cmp(ts[PAD + (i - 1) / D], t)) {
+      move(i, (i - 1) / D);
+      i = (i - 1) / D;
     }
-    blackbox(v);
+    place(i, std::move(t), handle);
+    return i;
   }
-  return misses;
-}
 
-struct rng_lehmer64 {
-  __uint128_t g_lehmer64_state;
-  rng_lehmer64(uint64_t seed) : g_lehmer64_state(seed) {}
+  size_t siftdown(size_t i) {
+    T t = std::move(ts[PAD + i]);
+    size_t handle = handles[PAD + i];
+    size_t n = size();
+    while (D * i + 1 < n) {
+      size_t first = D * i + 1;
+      size_t last = MIN(first + D, n);
+      size_t m = first;
+      for (size_t c = first + 1; c < last; c++) {
+        if (!_cmp(ts[PAD + m], ts[PAD + c])) {
+          m = c;
+        }
+      }
+      if (_cmp(t, ts[PAD + m])) {
+        break;
+      }
+      move(i, m);
+      i = m;
+    }
+    place(i, std::move(t), handle);
+    return i;
+  }
 
-  uint64_t operator()() {
-    g_lehmer64_state *= 0xda942042e4dd58b5;
-    return g_lehmer64_state >> 64;
+  bool is_heap() const {
+    for (size_t i = 1; i < size(); i++) {
+      if (!_cmp(ts[PAD + (i - 1) / D], ts[PAD + i])) {
+        return false;
+      }
+    }
+    return true;
   }
 };
 
-#define printf(...)
+template <class T, class Cmp = std::less_equal<T>>
+using quad_heap = dary_heap<T, 4, Cmp>;
+template <class T, class Cmp = std::less_equal<T>>
+using oct_heap = dary_heap<T, 8, Cmp>;
 
-std::pair<int, float> bench_lru(size_t item_count, size_t lru_size,
-                                size_t iter_count, bool prefill) {
-  LRU<unsigned int, unsigned int> lru(lru_size);
+// An intrusive doubly linked list whose nodes live in a stable_dyn_array
+// The front is the most recently used item, the back the least recently used
+template <class T> class recency_list {
+public:
+  struct list_handle {
+    size_t handle;
+  };
 
-  dyn_array<unsigned int> data(iter_count);
-  {
+private:
+  static constexpr size_t NIL = std::numeric_limits<size_t>::max();
+  struct node {
+    size_t prev;
+    size_t next;
+    T t;
+  };
+
+  stable_dyn_array<node> nodes;
+  size_t head = NIL;
+  size_t tail = NIL;
+  size_t _size = 0;
+  size_t _capacity;
+
+public:
+  recency_list(size_t size) : nodes(size), _capacity(size) {}
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _capacity; }
+
+  template <class Archive> void persist(Archive &ar) {
+    ar(nodes);
+    ar(head);
+    ar(tail);
+    ar(_size);
+    ar(_capacity);
+  }
+
+  list_handle push_front(T &&t) {
+    assert(_size < _capacity);
+    size_t idx = nodes.emplace(NIL, NIL, std::move(t));
+    link_front(idx);
+    _size++;
+    return {idx};
+  }
+
+  T &back() {
+    assert(_size > 0);
+    return nodes[tail].t;
+  }
+  list_handle back_handle() {
+    assert(_size > 0);
+    return {tail};
+  }
+
+  void move_to_front(list_handle handle) {
+    if (handle.handle == head) {
+      return;
+    }
+    unlink(handle.handle);
+    link_front(handle.handle);
+  }
+
+  void remove_back() {
+    assert(_size > 0);
+    remove(back_handle());
+  }
+
+  void remove(list_handle handle) {
+    assert(_size > 0);
+    unlink(handle.handle);
+    nodes.remove(handle.handle);
+    _size--;
+  }
+
+  T &operator[](list_handle handle) { return nodes[handle.handle].t; }
+  const T &operator[](list_handle handle) const {
+    return nodes[handle.handle].t;
+  }
+
+private:
+  void link_front(size_t idx) {
+    node &n = nodes[idx];
+    n.prev = NIL;
+    n.next = head;
+    if (head != NIL) {
+      nodes[head].prev = idx;
+    } else {
+      tail = idx;
+    }
+    head = idx;
+  }
+
+  void unlink(size_t idx) {
+    node &n = nodes[idx];
+    if (n.prev != NIL) {
+      nodes[n.prev].next = n.next;
+    } else {
+      head = n.next;
+    }
+    if (n.next != NIL) {
+      nodes[n.next].prev = n.prev;
+    } else {
+      tail = n.prev;
+    }
+  }
+};
+
+// Recency policies for LRU
+// A store owns the entries and orders them by last use: oldest() is the next
+// entry to evict
+// concurrent_touch tells whether touch() may run concurrently with itself
+struct heap_recency {
+  static constexpr const char *name = "heap";
+  static constexpr bool concurrent_touch = false;
+
+  // Every touch is a O(log n) update of the timestamp
+  template <class K, class V> class store {
+    struct I {
+      size_t t;
+      K k;
+      V v;
+      friend bool operator<=(const I &a, const I &b) { return a.t <= b.t; }
+    };
+    heap<I> h;
+    size_t time = 0;
+
+  public:
+    using handle_t = heap<I>::heap_handle;
+
+    store(size_t size) : h(size) {}
+
+    size_t size() const { return h.size(); }
+    size_t capacity() const { return h.capacity(); }
+
+    template <class Archive> void persist(Archive &ar) {
+      ar(h);
+      ar(time);
+    }
+
+    handle_t insert(K k, V v) { return h.insert(I{time++, k, std::move(v)}); }
+    void touch(handle_t handle) {
+      h.update(handle, [this](I &i) { i.t = time++; });
+    }
+    handle_t oldest() { return h.minimum_handle(); }
+    void replace(handle_t handle, K k, V v) {
+      h.update(handle, [&](I &i) { i = I{time++, k, std::move(v)}; });
+    }
+    void remove_oldest() { h.remove_minimum(); }
+    void remove(handle_t handle) { h.remove(handle); }
+
+    I &operator[](handle_t handle) { return h[handle]; }
+    void prefetch(handle_t handle) { __builtin_prefetch(&h[handle]); }
+  };
+};
+
+// The d-ary heap only orders {timestamp, entry} pairs, and the entries stay
+// put in a stable_dyn_array
+// A pair is packed in 8 bytes, so that the 8 children of a heap8 node fill one
+// cache line (and those of a heap4 node half of one): the timestamp in the
+// high TIME_BITS (40) bits, the entry in the others, so at most 16Mi entries.
+// The timestamps are unique, ordering by the whole word is ordering by time
+// When the timestamps run out, they start over from the rank of every entry
+template <size_t D, size_t TIME_BITS = 40> struct dary_heap_recency {
+  static constexpr const char *name = D == 4 ? "heap4" : "heap8";
+  static constexpr bool concurrent_touch = false;
+
+  template <class K, class V> class store {
+    static constexpr size_t ENTRY_BITS = 64 - TIME_BITS;
+    static constexpr size_t MAX_TIME = size_t(1) << TIME_BITS;
+
+    struct stamp {
+      uint64_t bits;
+
+      static stamp of(size_t t, size_t entry) {
+        assert(t < MAX_TIME);
+        return {uint64_t(t) << ENTRY_BITS | entry};
+      }
+      size_t entry() const { return bits & ((uint64_t(1) << ENTRY_BITS) - 1); }
+      friend bool operator<=(const stamp &a, const stamp &b) {
+        return a.bits <= b.bits;
+      }
+    };
+    static_assert(sizeof(stamp) * 8 == 64);
+    using heap_t = dary_heap<stamp, D>;
+    struct I {
+      K k;
+      V v;
+      heap_t::heap_handle h;
+    };
+    heap_t h;
+    stable_dyn_array<I> entries;
+    size_t time = 0;
+
+    size_t next_time() {
+      if (time == MAX_TIME) {
+        h.renumber(
+            [](stamp &s, size_t rank) { s = stamp::of(rank, s.entry()); });
+        time = h.size();
+      }
+      return time++;
+    }
+
+  public:
+    struct handle_t {
+      size_t handle;
+    };
+
+    // The entries past 2^ENTRY_BITS would spill into the timestamps
+    store(size_t size) : h(size), entries(size) {
+      if (size > size_t(1) << ENTRY_BITS) {
+        throw std::length_error("dary_heap_recency: too many entries");
+      }
+    }
+
+    size_t size() const { return h.size(); }
+    size_t capacity() const { return h.capacity(); }
+
+    template <class Archive> void persist(Archive &ar) {
+      ar(h);
+      ar(entries);
+      ar(time);
+    }
+
+    handle_t insert(K k, V v) {
+      size_t idx = entries.emplace(k, std::move(v));
+      entries[idx].h = h.insert(stamp::of(next_time(), idx));
+      return {idx};
+    }
+    void touch(handle_t handle) {
+      size_t t = next_time();
+      h.update(entries[handle.handle].h,
+               [t](stamp &s) { s = stamp::of(t, s.entry()); });
+    }
+    handle_t oldest() { return {h.minimum().entry()}; }
+    void replace(handle_t handle, K k, V v) {
+      I &i = entries[handle.handle];
+      i.k = k;
+      i.v = std::move(v);
+      touch(handle);
+    }
+    void remove_oldest() {
+      size_t idx = h.minimum().entry();
+      h.remove_minimum();
+      entries.remove(idx);
+    }
+    void remove(handle_t handle) {
+      h.remove(entries[handle.handle].h);
+      entries.remove(handle.handle);
+    }
+
+    I &operator[](handle_t handle) { return entries[handle.handle]; }
+    void prefetch(handle_t handle) {
+      __builtin_prefetch(&entries[handle.handle]);
+    }
+  };
+};
+
+using heap4_recency = dary_heap_recency<4>;
+using heap8_recency = dary_heap_recency<8>;
+
+struct list_recency {
+  static constexpr const char *name = "list";
+  static constexpr bool concurrent_touch = false;
+
+  // Every touch is a O(1) relink, no timestamp needed
+  template <class K, class V> class store {
+    struct I {
+      K k;
+      V v;
+    };
+    recency_list<I> l;
+
+  public:
+    using handle_t = recency_list<I>::list_handle;
+
+    store(size_t size) : l(size) {}
+
+    size_t size() const { return l.size(); }
+    size_t capacity() const { return l.capacity(); }
+
+    template <class Archive> void persist(Archive &ar) { ar(l); }
+
+    handle_t insert(K k, V v) { return l.push_front(I{k, std::move(v)}); }
+    void touch(handle_t handle) { l.move_to_front(handle); }
+    handle_t oldest() { return l.back_handle(); }
+    void replace(handle_t handle, K k, V v) {
+      l[handle] = I{k, std::move(v)};
+      l.move_to_front(handle);
+    }
+    void remove_oldest() { l.remove_back(); }
+    void remove(handle_t handle) { l.remove(handle); }
+
+    I &operator[](handle_t handle) { return l[handle]; }
+    void prefetch(handle_t handle) { __builtin_prefetch(&l[handle]); }
+  };
+};
+
+// CLOCK, aka second chance: an approximation of LRU
+// A touch only sets the reference bit of the entry, the hand sweeps the
+// entries in order, clears the bits it meets and evicts the first entry whose
+// bit was already clear
+struct clock_recency {
+  static constexpr const char *name = "clock";
+  static constexpr bool concurrent_touch = true;
+
+  template <class K, class V> class store {
+    struct I {
+      K k;
+      V v;
+      std::atomic<bool> referenced;
+    };
+    dyn_array<I> slots;
+    size_t hand = 0;
+
+  public:
+    struct handle_t {
+      size_t handle;
+    };
+
+    store(size_t size) : slots(size) {}
+
+    size_t size() const { return slots.size(); }
+    size_t capacity() const { return slots.capacity(); }
+
+    template <class Archive> void persist(Archive &ar) {
+      ar(slots);
+      ar(hand);
+    }
+
+    handle_t insert(K k, V v) {
+      slots.emplace(k, std::move(v), false);
+      return {slots.size() - 1};
+    }
+    void touch(handle_t handle) {
+      // Do not dirty the cache line when the bit is already set
+      std::atomic<bool> &r = slots[handle.handle].referenced;
+      if (!r.load(std::memory_order_relaxed)) {
+        r.store(true, std::memory_order_relaxed);
+      }
+    }
+    handle_t oldest() {
+      assert(size() == capacity());
+      for (;;) {
+        size_t i = hand;
+        hand = hand + 1 == capacity() ? 0 : hand + 1;
+        if (!slots[i].referenced.exchange(false, std::memory_order_relaxed)) {
+          return {i};
+        }
+      }
+    }
+    // The slot oldest() stops at, without moving the hand or clearing the
+    // bits: the first one not referenced, or the hand when all of them are
+    handle_t peek_oldest() const {
+      assert(size() == capacity());
+      for (size_t n = 0, i = hand; n < capacity(); n++) {
+        if (!slots[i].referenced.load(std::memory_order_relaxed)) {
+          return {i};
+        }
+        i = i + 1 == capacity() ? 0 : i + 1;
+      }
+      return {hand};
+    }
+    void replace(handle_t handle, K k, V v) {
+      I &i = slots[handle.handle];
+      i.k = k;
+      i.v = std::move(v);
+      i.referenced.store(false, std::memory_order_relaxed);
+    }
+
+    I &operator[](handle_t handle) { return slots[handle.handle]; }
+    void prefetch(handle_t handle) {
+      __builtin_prefetch(&slots[handle.handle]);
+    }
+
+    // As flat_index::find_racy: the slots never move (the store is never
+    // resized past its capacity) and a handle out of them is rejected
+    std::optional<V> read_racy(handle_t handle, K k) const {
+      if (handle.handle >= slots.size()) {
+        return {};
+      }
+      const I &i = slots[handle.handle];
+      if (!(i.k == k)) {
+        return {};
+      }
+      return i.v;
+    }
+  };
+};
+
+// Key indexes for LRU
+// A map from a key to the handle of its entry, holding at most `size` keys
+struct node_index {
+  static constexpr const char *name = "unordered_map";
+
+  template <class K, class H> class map {
+    std::unordered_map<K, H> m;
+
+  public:
+    map(size_t size) { m.reserve(4 * size); }
+
+    H *find(K k) {
+      auto it = m.find(k);
+      return it != m.end() ? &it->second : nullptr;
+    }
+    void insert(K k, H h) { m.emplace(k, h); }
+
+    // The buckets are out of reach, batches can't prefetch anything
+    size_t hash(K k) const { return 0; }
+    void prefetch(size_t hash) const {}
+    H *find(K k, size_t hash) { return find(k); }
+    void erase(K k) { m.erase(k); }
+  };
+};
+
+// Linear probing in a flat power of two table, load factor is kept under 1/2
+// Deletion shifts the following entries back (Knuth's algorithm R) so that
+// there is no tombstone
+struct flat_index {
+  static constexpr const char *name = "flat";
+
+  template <class K, class H> class map {
+    static_assert(std::is_trivially_copyable_v<K> &&
+                  std::is_trivially_copyable_v<H>);
+
+    struct slot {
+      bool used;
+      K k;
+      H h;
+    };
+
+    dyn_array<slot> slots;
+    size_t mask;
+    // 64 - log2 of the slot count
+    size_t shift;
+
+    size_t home(K k) const {
+      // fibonacci hashing, the top bits are the best mixed
+      uint64_t x = uint64_t(std::hash<K>{}(k)) * 0x9e3779b97f4a7c15ull;
+      return x >> shift;
+    }
+
+    // The slot holding k, or the empty slot where it would be inserted
+    size_t probe(K k) const { return probe(k, home(k)); }
+    size_t probe(K k, size_t i) const {
+      while (slots[i].used && !(slots[i].k == k)) {
+        i = (i + 1) & mask;
+      }
+      return i;
+    }
+
+  public:
+    map(size_t size) : slots(std::bit_ceil(MAX(2 * size, size_t(8)))) {
+      mask = slots.capacity() - 1;
+      shift = 64 - std::countr_zero(slots.capacity());
+      for (size_t i = 0; i < slots.capacity(); i++) {
+        slots.push(slot{false, {}, {}});
+      }
+    }
+
+    template <class Archive> void persist(Archive &ar) {
+      ar(slots);
+      ar(mask);
+      ar(shift);
+    }
+
+    H *find(K k) {
+      slot &s = slots[probe(k)];
+      return s.used ? &s.h : nullptr;
+    }
+
+    // For optimistic readers racing with a writer (sharded_lru): whatever
+    // they read, they probe every slot at most once and copy the handle out,
+    // the caller validates it
+    bool find_racy(K k, H &h) const {
+      size_t i = home(k);
+      for (size_t n = 0; n <= mask; n++) {
+        const slot &s = slots[i];
+        if (!s.used) {
+          return false;
+        }
+        if (s.k == k) {
+          h = s.h;
+          return true;
+        }
+        i = (i + 1) & mask;
+      }
+      return false;
+    }
+
+    // For batches: hash first, prefetch, and find later
+    size_t hash(K k) const { return home(k); }
+    void prefetch(size_t hash) const { __builtin_prefetch(&slots[hash]); }
+    H *find(K k, size_t hash) {
+      slot &s = slots[probe(k, hash)];
+      return s.used ? &s.h : nullptr;
+    }
+
+    void insert(K k, H h) {
+      slot &s = slots[probe(k)];
+      if (!s.used) {
+        s = slot{true, k, h};
+      }
+    }
+
+    void erase(K k) {
+      size_t i = probe(k);
+      if (!slots[i].used) {
+        return;
+      }
+
+      size_t j = i;
+      for (;;) {
+        j = (j + 1) & mask;
+        if (!slots[j].used) {
+          break;
+        }
+        // slots[j] may fill the hole only if the hole lies on its probe path
+        size_t h = home(slots[j].k);
+        if (((j - h) & mask) >= ((j - i) & mask)) {
+          slots[i] = slots[j];
+          i = j;
+        }
+      }
+      slots[i].used = false;
+    }
+  };
+};
+
+// Expiry policies, for per entry deadlines
+// A deadline is in whatever unit the caller gives `now` in, and is past once
+// it is <= now
+struct no_expiry {
+  static constexpr const char *name = "none";
+
+  class deadlines {
+  public:
+    deadlines(size_t) {}
+    void set(size_t entry, uint64_t deadline) {}
+    void clear(size_t entry) {}
+    bool expired(size_t entry, uint64_t now) const { return false; }
+    std::optional<size_t> next_expired(uint64_t now) { return {}; }
+    template <class Archive> void persist(Archive &ar) {}
+  };
+};
+
+// The deadlines are ordered by a second heap, beside the recency order
+// Entries are the indices of the store handles, an entry without a deadline
+// has no item in the heap
+struct heap_expiry {
+  static constexpr const char *name = "heap";
+
+  class deadlines {
+    struct I {
+      uint64_t deadline;
+      size_t entry;
+      friend bool operator<=(const I &a, const I &b) {
+        return a.deadline <= b.deadline;
+      }
+    };
+    using handle_t = heap<I>::heap_handle;
+    static constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+    heap<I> h;
+    // The heap handle of every entry, NONE without a deadline
+    dyn_array<size_t> of_entry;
+
+  public:
+    deadlines(size_t size) : h(size), of_entry(size) {}
+
+    void set(size_t entry, uint64_t deadline) {
+      while (of_entry.size() <= entry) {
+        of_entry.push(NONE);
+      }
+      if (of_entry[entry] == NONE) {
+        of_entry[entry] = h.insert(I{deadline, entry}).handle;
+      } else {
+        h.update({of_entry[entry]}, [&](I &i) { i.deadline = deadline; });
+      }
+    }
+
+    void clear(size_t entry) {
+      if (entry < of_entry.size() && of_entry[entry] != NONE) {
+        h.remove({std::exchange(of_entry[entry], NONE)});
+      }
+    }
+
+    bool expired(size_t entry, uint64_t now) const {
+      return entry < of_entry.size() && of_entry[entry] != NONE &&
+             h[handle_t{of_entry[entry]}].deadline <= now;
+    }
+
+    // The entry with the earliest deadline, if it is past
+    std::optional<size_t> next_expired(uint64_t now) {
+      if (h.size() > 0 && h.minimum().deadline <= now) {
+        return h.minimum().entry;
+      }
+      return {};
+    }
+
+    template <class Archive> void persist(Archive &ar) {
+      ar(h);
+      ar(of_entry);
+    }
+  };
+};
+
+// Snapshots
+// Handles are indices, so the arrays of a cache can be written as they are,
+// each on its own pages, and mapped back privately (copy on write) with no
+// deserialization. The scalars around them go in a blob after the header
+// A component lists its state in `template <class Archive> void
+// persist(Archive &ar)` by calling ar() on each member
+template <class T> struct is_dyn_array : std::false_type {};
+template <class T> struct is_dyn_array<dyn_array<T>> : std::true_type {};
+
+struct snapshot_header {
+  char magic[8];
+  // The policies and the key and value types: a snapshot only reopens in the
+  // same instantiation
+  char layout[112];
+  uint64_t values_bytes;
+  uint64_t array_count;
+};
+
+struct snapshot_section {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t capacity;
+  uint64_t item_size;
+  // Room for capacity items, rounded to pages
+  uint64_t bytes;
+};
+
+static constexpr char SNAPSHOT_MAGIC[8] = {'L', 'R', 'U', 'S',
+                                            'N', 'A', 'P', '3'};
+
+static size_t round_to_page(size_t bytes) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (bytes + page - 1) / page * page;
+}
+
+class snapshot_writer {
+  struct array {
+    const void *data;
+    size_t size;
+    size_t capacity;
+    size_t item_size;
+  };
+  std::vector<std::byte> values;
+  std::vector<array> arrays;
+
+public:
+  template <class T> void operator()(T &t) {
+    if constexpr (is_dyn_array<T>::value) {
+      using U = T::value_type;
+      static_assert(is_trivially_relocatable<U>());
+      arrays.push_back({t.data(), t.size(), t.capacity(), sizeof(U)});
+    } else if constexpr (requires { t.persist(*this); }) {
+      t.persist(*this);
+    } else {
+      static_assert(std::is_trivially_copyable_v<T>,
+                    "can't be part of a snapshot");
+      auto bytes = (const std::byte *)&t;
+      values.insert(values.end(), bytes, bytes + sizeof(T));
+    }
+  }
+
+  // The file is as large as the capacities, past the sizes it is sparse
+  bool write(const char *path, const char *layout) const {
+    snapshot_header header{};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    snprintf(header.layout, sizeof(header.layout), "%s", layout);
+    header.values_bytes = values.size();
+    header.array_count = arrays.size();
+
+    std::vector<snapshot_section> sections;
+    size_t offset = round_to_page(sizeof(header) + values.size() +
+                                  arrays.size() * sizeof(snapshot_section));
+    for (auto &a : arrays) {
+      size_t bytes = round_to_page(a.capacity * a.item_size);
+      sections.push_back({offset, a.size, a.capacity, a.item_size, bytes});
+      offset += bytes;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+      return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    ok = ok && fwrite(values.data(), 1, values.size(), f) == values.size();
+    ok = ok && fwrite(sections.data(), sizeof(snapshot_section),
+                      sections.size(), f) == sections.size();
+    for (size_t i = 0; i < arrays.size(); i++) {
+      size_t bytes = arrays[i].size * arrays[i].item_size;
+      ok = ok && fseek(f, sections[i].offset, SEEK_SET) == 0;
+      ok = ok && fwrite(arrays[i].data, 1, bytes, f) == bytes;
+    }
+    ok = ok && fflush(f) == 0 && ftruncate(fileno(f), offset) == 0;
+    return fclose(f) == 0 && ok;
+  }
+};
+
+// Maps a whole snapshot, the arrays adopt their sections and the header pages
+// are unmapped with the reader
+class snapshot_reader {
+  std::byte *base;
+  size_t header_bytes;
+  const std::byte *values;
+  size_t values_left;
+  const snapshot_section *sections;
+  size_t sections_left;
+  bool failed = false;
+
+  snapshot_reader(std::byte *base, size_t header_bytes)
+      : base(base), header_bytes(header_bytes) {
+    auto &header = *(const snapshot_header *)base;
+    values = base + sizeof(snapshot_header);
+    values_left = header.values_bytes;
+    sections = (const snapshot_section *)(values + values_left);
+    sections_left = header.array_count;
+  }
+
+public:
+  snapshot_reader(const snapshot_reader &) = delete;
+  snapshot_reader(snapshot_reader &&other)
+      : base(std::exchange(other.base, nullptr)),
+        header_bytes(other.header_bytes), values(other.values),
+        values_left(other.values_left), sections(other.sections),
+        sections_left(other.sections_left), failed(other.failed) {}
+
+  // Nothing when the file is missing, truncated, or of another layout
+  static std::optional<snapshot_reader> open(const char *path,
+                                             const char *layout) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return {};
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(snapshot_header)) {
+      close(fd);
+      return {};
+    }
+    size_t file_bytes = st.st_size;
+    void *p = mmap(nullptr, file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      return {};
+    }
+    auto base = (std::byte *)p;
+
+    // Every count is checked against the file size before any sum or
+    // product, so that a corrupt one can't wrap around
+    auto &header = *(const snapshot_header *)base;
+    bool ok = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+              strncmp(header.layout, layout, sizeof(header.layout)) == 0 &&
+              header.values_bytes <= file_bytes &&
+              header.array_count <= file_bytes / sizeof(snapshot_section);
+    size_t table = sizeof(header) + header.values_bytes;
+    size_t table_end = table + header.array_count * sizeof(snapshot_section);
+    ok = ok && table_end <= file_bytes;
+    size_t header_bytes = round_to_page(table_end);
+    for (size_t i = 0; ok && i < header.array_count; i++) {
+      auto &s = ((const snapshot_section *)(base + table))[i];
+      ok = s.offset % round_to_page(1) == 0 && s.offset >= header_bytes &&
+           s.offset <= file_bytes && s.bytes <= file_bytes - s.offset &&
+           s.item_size > 0 && s.capacity <= s.bytes / s.item_size &&
+           s.size <= s.capacity;
+    }
+    if (!ok) {
+      munmap(base, file_bytes);
+      return {};
+    }
+    madvise(base, file_bytes, MADV_WILLNEED);
+    return snapshot_reader(base, header_bytes);
+  }
+
+  ~snapshot_reader() {
+    if (base) {
+      munmap(base, header_bytes);
+    }
+  }
+
+  // What doesn't match the file (a section of another item size, too few
+  // values or sections) is left empty and fails done()
+  template <class T> void operator()(T &t) {
+    if constexpr (is_dyn_array<T>::value) {
+      if (sections_left == 0 ||
+          sections->item_size != sizeof(typename T::value_type)) {
+        failed = true;
+        t = T(0);
+        return;
+      }
+      const snapshot_section &s = *sections++;
+      sections_left--;
+      t = s.bytes == 0 ? T(0)
+                       : T::adopt(base + s.offset, s.bytes, s.size, s.capacity);
+    } else if constexpr (requires { t.persist(*this); }) {
+      t.persist(*this);
+    } else {
+      static_assert(std::is_trivially_copyable_v<T>,
+                    "can't be part of a snapshot");
+      if (values_left < sizeof(T)) {
+        failed = true;
+        return;
+      }
+      memcpy((void *)&t, values, sizeof(T));
+      values += sizeof(T);
+      values_left -= sizeof(T);
+    }
+  }
+
+  bool done() const {
+    return !failed && values_left == 0 && sections_left == 0;
+  }
+};
+
+template <class K, class V, class Recency = heap_recency,
+          class Index = node_index, class Expiry = no_expiry>
+class LRU {
+public:
+  using store_t = Recency::template store<K, V>;
+  using handle_t = store_t::handle_t;
+  store_t h;
+  Index::template map<K, handle_t> key2handle;
+  [[no_unique_address]] Expiry::deadlines deadlines;
+
+  static constexpr bool EXPIRY = !std::is_same_v<Expiry, no_expiry>;
+  static_assert(!EXPIRY || requires(store_t s, handle_t h) { s.remove(h); },
+                "deadlines need a store that can remove any entry");
+
+  LRU(size_t size) : h(size), key2handle(size), deadlines(size) {}
+
+  std::optional<std::reference_wrapper<V>> find(K k) {
+    handle_t *handle = key2handle.find(k);
+    if (handle) {
+      h.touch(*handle);
+      return h[*handle].v;
+    }
+    return {};
+  }
+
+  // An entry past its deadline is removed, and missed
+  std::optional<std::reference_wrapper<V>> find(K k, uint64_t now)
+    requires EXPIRY
+  {
+    handle_t *handle = key2handle.find(k);
+    if (!handle) {
+      return {};
+    }
+    if (deadlines.expired(handle->handle, now)) {
+      remove(*handle);
+      return {};
+    }
+    h.touch(*handle);
+    return h[*handle].v;
+  }
+
+  // Removes every entry past its deadline, returns how many
+  size_t expire(uint64_t now)
+    requires EXPIRY
+  {
+    size_t count = 0;
+    while (auto entry = deadlines.next_expired(now)) {
+      remove(handle_t{*entry});
+      count++;
+    }
+    return count;
+  }
+
+  // Looks up all the keys, a missing key gets a nullptr
+  // Every pass goes over the whole chunk before the next one so that the
+  // cache misses of a chunk overlap: hash the keys and prefetch their slots
+  // in the index, probe the index and prefetch the entries, touch them
+  // The pointers are valid until the next insert
+  void find_batch(std::span<const K> keys, std::span<V *> out) {
+    assert(keys.size() == out.size());
+    constexpr size_t CHUNK = 64;
+    std::array<size_t, CHUNK> hashes;
+    std::array<handle_t *, CHUNK> handles;
+
+    for (size_t base = 0; base < keys.size(); base += CHUNK) {
+      size_t n = std::min(CHUNK, keys.size() - base);
+      for (size_t i = 0; i < n; i++) {
+        hashes[i] = key2handle.hash(keys[base + i]);
+        key2handle.prefetch(hashes[i]);
+      }
+      for (size_t i = 0; i < n; i++) {
+        handles[i] = key2handle.find(keys[base + i], hashes[i]);
+        if (handles[i]) {
+          h.prefetch(*handles[i]);
+        }
+      }
+      for (size_t i = 0; i < n; i++) {
+        out[base + i] = nullptr;
+        if (handles[i]) {
+          h.touch(*handles[i]);
+          out[base + i] = &h[*handles[i]].v;
+        }
+      }
+    }
+  }
+
+  V &insert(K k, V v) { return h[insert_entry(k, std::move(v))].v; }
+
+  V &insert(K k, V v, uint64_t deadline)
+    requires EXPIRY
+  {
+    handle_t handle = insert_entry(k, std::move(v));
+    deadlines.set(handle.handle, deadline);
+    return h[handle].v;
+  }
+
+  V &find_or_insert(K k, auto Fn) {
+    auto a = find(k);
+    if (a) {
+      return a.value();
+    };
+    auto v = Fn();
+    return insert(k, v);
+  }
+
+  bool full() const { return h.size() == h.capacity(); }
+  size_t size() const { return h.size(); }
+
+  // The entry the next insert evicts once the cache is full
+  // CLOCK can't look for it with oldest() that moves the hand
+  std::pair<K, V &> victim() {
+    assert(h.size() > 0);
+    handle_t handle;
+    if constexpr (requires { h.peek_oldest(); }) {
+      handle = h.peek_oldest();
+    } else {
+      handle = h.oldest();
+    }
+    auto &i = h[handle];
+    return {i.k, i.v};
+  }
+
+  // Removes the victim, not available with CLOCK that can't leave holes
+  void evict()
+    requires requires(store_t s) { s.remove_oldest(); }
+  {
+    handle_t handle = h.oldest();
+    key2handle.erase(h[handle].k);
+    deadlines.clear(handle.handle);
+    h.remove_oldest();
+  }
+
+  // Snapshots need trivially copyable keys and values, and an index that
+  // persists (flat_index, not node_index)
+  static constexpr bool SNAPSHOTS =
+      std::is_trivially_copyable_v<K> && std::is_trivially_copyable_v<V> &&
+      requires(Index::template map<K, handle_t> m, snapshot_writer w) {
+        m.persist(w);
+      };
+
+  template <class Archive>
+  void persist(Archive &ar)
+    requires SNAPSHOTS
+  {
+    ar(h);
+    ar(key2handle);
+    ar(deadlines);
+  }
+
+  bool save(const char *path)
+    requires SNAPSHOTS
+  {
+    snapshot_writer w;
+    persist(w);
+    return w.write(path, layout().data());
+  }
+
+  // Nothing is read or copied: the pages come in as they are touched, and are
+  // copied on write, the file stays as it was saved
+  static std::optional<LRU> open(const char *path)
+    requires SNAPSHOTS
+  {
+    auto r = snapshot_reader::open(path, layout().data());
+    if (!r) {
+      return {};
+    }
+    std::optional<LRU> lru(std::in_place, 0);
+    lru->persist(*r);
+    if (!r->done()) {
+      return {};
+    }
+    return lru;
+  }
+
+private:
+  static std::array<char, 112> layout() {
+    std::array<char, 112> l;
+    snprintf(l.data(), l.size(), "%s;%s;%s;%zu;%zu;%zu;%zu", Recency::name,
+             Index::name, Expiry::name, sizeof(K), alignof(K), sizeof(V),
+             alignof(V));
+    return l;
+  }
+
+  // A key already there gets the value in place, and is touched
+  // Else the victim makes room when full, its deadline goes with it
+  handle_t insert_entry(K k, V v) {
+    handle_t handle;
+
+    if (handle_t *existing = key2handle.find(k)) {
+      handle = *existing;
+      h[handle].v = std::move(v);
+      h.touch(handle);
+      deadlines.clear(handle.handle);
+      return handle;
+    }
+    if (h.size() == h.capacity()) {
+      handle = h.oldest();
+      key2handle.erase(h[handle].k);
+      deadlines.clear(handle.handle);
+      h.replace(handle, k, std::move(v));
+    } else {
+      handle = h.insert(k, std::move(v));
+    }
+    key2handle.insert(k, handle);
+    return handle;
+  }
+
+  void remove(handle_t handle)
+    requires EXPIRY
+  {
+    key2handle.erase(h[handle].k);
+    deadlines.clear(handle.handle);
+    h.remove(handle);
+  }
+};
+
+template class LRU<int, std::string, heap_recency>;
+template class LRU<int, std::string, list_recency>;
+template class LRU<int, std::string, heap_recency, flat_index>;
+template class LRU<int, std::string, list_recency, flat_index>;
+template class LRU<int, std::string, clock_recency, flat_index>;
+template class LRU<int, std::string, heap4_recency, flat_index>;
+template class LRU<int, std::string, heap8_recency, flat_index>;
+template class LRU<int, std::string, heap_recency, flat_index, heap_expiry>;
+template class LRU<int, std::string, list_recency, node_index, heap_expiry>;
+template class LRU<int, int, heap4_recency, flat_index, heap_expiry>;
+
+// A count-min sketch of 4 bit counters, 16 to a word
+// Every row has 4 counters per entry of the cache, and every 10 increments per
+// entry all the counters are halved so that the frequencies follow the recent
+// history
+template <class K> class count_min_sketch {
+  static constexpr size_t DEPTH = 4;
+
+  dyn_array<uint64_t> table;
+  size_t mask;
+  size_t additions = 0;
+  size_t sample;
+
+  // Index of the counter of k in row r
+  size_t counter(K k, size_t r) const {
+    uint64_t x = uint64_t(std::hash<K>{}(k)) + r * 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return r * (mask + 1) + ((x ^ (x >> 31)) & mask);
+  }
+  uint8_t get(size_t c) const { return (table[c / 16] >> (c % 16 * 4)) & 0xf; }
+
+public:
+  count_min_sketch(size_t size)
+      : table(DEPTH * std::bit_ceil(MAX(4 * size, size_t(16))) / 16) {
+    mask = table.capacity() / DEPTH * 16 - 1;
+    sample = 10 * size;
+    for (size_t i = 0; i < table.capacity(); i++) {
+      table.push(0);
+    }
+  }
+
+  uint8_t estimate(K k) const {
+    uint8_t m = 15;
+    for (size_t r = 0; r < DEPTH; r++) {
+      m = std::min(m, get(counter(k, r)));
+    }
+    return m;
+  }
+
+  void increment(K k) {
+    for (size_t r = 0; r < DEPTH; r++) {
+      size_t c = counter(k, r);
+      if (get(c) < 15) {
+        table[c / 16] += uint64_t(1) << (c % 16 * 4);
+      }
+    }
+
+    if (++additions == sample) {
+      for (auto &w : table) {
+        w = (w >> 1) & 0x7777777777777777ull;
+      }
+      additions /= 2;
+    }
+  }
+};
+
+// Miss rate curves in one pass over a trace, from Mattson's stack distances:
+// an LRU of size c hits exactly the accesses whose key was accessed less than
+// c distinct keys ago
+// A Fenwick tree over the access times holds a 1 at the last access of every
+// key, the distance of an access is the count of ones since the previous
+// access of its key: O(log n) per access
+// Below a rate of 1, only the keys whose hash falls under the rate are
+// tracked (SHARDS), and their distances are scaled by 1 / rate
+template <class K> class stack_distance {
+  dyn_array<uint64_t> tree;
+  node_index::map<K, size_t> last_access;
+  // histogram[d]: the tracked accesses at (scaled) distance d
+  std::vector<uint64_t> histogram;
+  uint64_t cold = 0;
+  uint64_t accesses = 0;
+  double rate;
+  uint64_t threshold;
+
+  // The sum of the first i times
+  uint64_t prefix(size_t i) const {
+    uint64_t sum = 0;
+    for (; i > 0; i -= i & -i) {
+      sum += tree[i - 1];
+    }
+    return sum;
+  }
+  void add(size_t i, int64_t delta) {
+    for (; i <= tree.size(); i += i & -i) {
+      tree[i - 1] += delta;
+    }
+  }
+  // Node i sums the times (i - lowbit(i), i]: all of them but the new one
+  // are already counted
+  void append_one() {
+    size_t i = tree.size() + 1;
+    tree.push(prefix(i - 1) - prefix(i - (i & -i)) + 1);
+  }
+
+public:
+  stack_distance(double rate = 1.0)
+      : tree(1024), last_access(1024), rate(rate),
+        threshold(rate >= 1.0 ? std::numeric_limits<uint64_t>::max()
+                              : uint64_t(rate * 0x1.0p64)) {
+    assert(rate > 0 && rate <= 1.0);
+  }
+
+  void access(K k) {
+    accesses++;
+    uint64_t x = uint64_t(std::hash<K>{}(k)) * 0x9e3779b97f4a7c15ull;
+    if (x > threshold) {
+      return;
+    }
+
+    append_one();
+    size_t now = tree.size();
+    size_t *last = last_access.find(k);
+    if (!last) {
+      cold++;
+      last_access.insert(k, now);
+      return;
+    }
+    size_t distance = size_t(double(prefix(now - 1) - prefix(*last)) / rate);
+    add(*last, -1);
+    *last = now;
+    if (distance >= histogram.size()) {
+      histogram.resize(distance + 1);
+    }
+    histogram[distance]++;
+  }
+
+  // Of all the accesses so far, scaled back from the tracked ones
+  double missrate(size_t lru_size) const {
+    uint64_t misses = cold;
+    for (size_t d = lru_size; d < histogram.size(); d++) {
+      misses += histogram[d];
+    }
+    return tree.size() > 0 ? double(misses) / double(tree.size()) : 0;
+  }
+  uint64_t misses(size_t lru_size) const {
+    return uint64_t(missrate(lru_size) * double(accesses) + 0.5);
+  }
+  uint64_t access_count() const { return accesses; }
+  // The distinct keys seen, scaled back as well
+  uint64_t key_count() const { return uint64_t(double(cold) / rate + 0.5); }
+};
+
+// Admission policies, put in front of the LRU
+struct no_admission {
+  static constexpr const char *name = "none";
+
+  template <class K, class V, class Recency, class Index,
+            class Expiry = no_expiry>
+  using cache = LRU<K, V, Recency, Index, Expiry>;
+};
+
+// W-TinyLFU: new keys go to a small window LRU, the entries evicted from the
+// window then replace the victim of the main LRU only if they were accessed
+// more often according to the sketch
+// A scan only goes through the window and leaves the main LRU untouched
+struct tinylfu_admission {
+  static constexpr const char *name = "tinylfu";
+
+  template <class K, class V, class Recency, class Index> class cache {
+    count_min_sketch<K> sketch;
+    LRU<K, V, Recency, Index> window;
+    LRU<K, V, Recency, Index> main;
+
+  public:
+    // 1% of the entries for the window, as in the paper
+    cache(size_t size)
+        : sketch(size), window(MAX(size / 100, size_t(1))),
+          main(size - MAX(size / 100, size_t(1))) {
+      assert(size >= 2);
+    }
+
+    std::optional<std::reference_wrapper<V>> find(K k) {
+      sketch.increment(k);
+      auto v = window.find(k);
+      if (v) {
+        return v;
+      }
+      return main.find(k);
+    }
+
+    V &insert(K k, V v) {
+      if (window.full()) {
+        auto [candidate, candidate_v] = window.victim();
+        admit(candidate, std::move(candidate_v));
+      }
+      return window.insert(k, std::move(v));
+    }
+
+    V &find_or_insert(K k, auto Fn) {
+      auto a = find(k);
+      if (a) {
+        return a.value();
+      };
+      auto v = Fn();
+      return insert(k, v);
+    }
+
+  private:
+    void admit(K k, V v) {
+      if (main.full() &&
+          sketch.estimate(k) <= sketch.estimate(main.victim().first)) {
+        return;
+      }
+      main.insert(k, std::move(v));
+    }
+  };
+};
+
+// Chunks of power of two sizes, from 16B to 64KiB
+// Every size class carves its chunks out of slabs of 16 chunks (64KiB at
+// least) and recycles them through a free list: a freed chunk is reused by a
+// value of the same class and the large values don't fragment the heap
+// The slabs are never given back nor moved to another class, the memory of a
+// class that is not used anymore stays there: a workload whose sizes drift
+// ends up with slabs for every class. As the live bytes of a class never
+// exceed the budget plus the chunk being inserted, a class never needs more
+// than budget / slab size + 2 slabs, which max_slab_bytes() sums up: about 13
+// times the budget in the worst case
+class slab_arena {
+public:
+  static constexpr size_t MIN_SHIFT = 4;
+  static constexpr size_t MAX_SHIFT = 16;
+  static constexpr size_t MIN_SLAB_SIZE = 1 << 16;
+
+private:
+  struct size_class {
+    // The next free chunk is written in the free chunk itself
+    std::byte *free = nullptr;
+    std::byte *bump = nullptr;
+    std::byte *bump_end = nullptr;
+  };
+
+  std::array<size_class, MAX_SHIFT - MIN_SHIFT + 1> classes;
+  dyn_array<std::byte *> slabs;
+  size_t _slab_bytes = 0;
+
+  static size_t class_of(size_t n) {
+    return std::bit_width(MAX(n, size_t(1) << MIN_SHIFT) - 1) - MIN_SHIFT;
+  }
+
+  static size_t slab_size(size_t chunk) {
+    return MAX(MIN_SLAB_SIZE, 16 * chunk);
+  }
+
+public:
+  slab_arena(size_t budget)
+      : slabs((budget / MIN_SLAB_SIZE + 2) * (MAX_SHIFT - MIN_SHIFT + 1)) {}
+  slab_arena(const slab_arena &) = delete;
+  slab_arena &operator=(const slab_arena &) = delete;
+  ~slab_arena() {
+    for (auto s : slabs) {
+      std::free(s);
+    }
+  }
+
+  // The bytes a value of size n really uses
+  static size_t chunk_size(size_t n) {
+    return std::bit_ceil(MAX(n, size_t(1) << MIN_SHIFT));
+  }
+  size_t slab_bytes() const { return _slab_bytes; }
+
+  // The most slab_bytes() can reach when the live chunks are charged against
+  // budget, whatever the sizes
+  static size_t max_slab_bytes(size_t budget) {
+    size_t bytes = 0;
+    for (size_t shift = MIN_SHIFT; shift <= MAX_SHIFT; shift++) {
+      size_t slab = slab_size(size_t(1) << shift);
+      bytes += (budget / slab + 2) * slab;
+    }
+    return bytes;
+  }
+
+  // Throws std::bad_alloc when a slab can't be allocated
+  void *alloc(size_t n) {
+    assert(n <= size_t(1) << MAX_SHIFT);
+    size_class &c = classes[class_of(n)];
+    if (c.free) {
+      std::byte *p = c.free;
+      memcpy(&c.free, p, sizeof(c.free));
+      return p;
+    }
+    if (c.bump == c.bump_end) {
+      size_t size = slab_size(chunk_size(n));
+      auto slab = (std::byte *)std::aligned_alloc(4096, size);
+      if (slab == nullptr) {
+        throw std::bad_alloc();
+      }
+      slabs.push(slab);
+      c.bump = slab;
+      c.bump_end = slab + size;
+      _slab_bytes += size;
+    }
+    std::byte *p = c.bump;
+    c.bump += chunk_size(n);
+    return p;
+  }
+
+  void free(void *p, size_t n) {
+    size_class &c = classes[class_of(n)];
+    memcpy(p, &c.free, sizeof(c.free));
+    c.free = (std::byte *)p;
+  }
+};
+
+// An LRU bounded by bytes rather than by entries
+// V is a variable size, trivially copyable object, think a header followed by
+// its payload: size_of(v) tells how many bytes it spans, up to 64KiB
+// The values are copied in a slab_arena and charged the size of their chunk
+template <class K, class V, class SizeOf, class Recency = list_recency,
+          class Index = flat_index>
+class byte_lru {
+  static_assert(std::is_trivially_copyable_v<V> && alignof(V) <= 16);
+
+  struct blob {
+    V *v;
+    size_t size;
+  };
+
+  slab_arena arena;
+  LRU<K, blob, Recency, Index> lru;
+  SizeOf size_of;
+  size_t budget;
+  size_t used = 0;
+
+public:
+  // The LRU is sized for max_entries and evicts when full rather than grow its
+  // arrays: max_entries bounds the number of entries, whatever their sizes
+  byte_lru(size_t budget, size_t max_entries, SizeOf size_of = {})
+      : arena(budget), lru(max_entries), size_of(size_of), budget(budget) {}
+
+  V *find(K k) {
+    auto b = lru.find(k);
+    return b ? b->get().v : nullptr;
+  }
+
+  // Evicts as many entries as needed for v to fit
+  // A key already there gives its chunk back first and keeps its entry, which
+  // the lookup made the most recent: it is only evicted when it is alone, and
+  // then the budget is empty
+  // The chunk is allocated before anything changes, so that a std::bad_alloc
+  // leaves the cache as it was
+  V *insert(K k, const V &v) {
+    size_t n = size_of(v);
+    size_t charge = slab_arena::chunk_size(n);
+    assert(charge <= budget);
+    V *p = (V *)arena.alloc(n);
+    bool present = false;
+    if (auto b = lru.find(k)) {
+      present = true;
+      arena.free(b->get().v, b->get().size);
+      used -= slab_arena::chunk_size(b->get().size);
+    }
+    while ((!present && lru.full()) || used + charge > budget) {
+      auto [victim, old] = lru.victim();
+      assert(victim != k);
+      arena.free(old.v, old.size);
+      used -= slab_arena::chunk_size(old.size);
+      lru.evict();
+    }
+
+    memcpy((void *)p, &v, n);
+    used += charge;
+    if (present) {
+      // The evictions may have moved the entry
+      lru.find(k)->get() = blob{p, n};
+    } else {
+      lru.insert(k, blob{p, n});
+    }
+    return p;
+  }
+
+  size_t used_bytes() const { return used; }
+  size_t slab_bytes() const { return arena.slab_bytes(); }
+};
+
+// The futex based mutex of mutex/mutex.c
+class futex_mutex {
+  enum : uint32_t { Unlocked, Locked, Locked_With_Waiter };
+  std::atomic<uint32_t> futex = Unlocked;
+
+public:
+  void lock() {
+    uint32_t fut = Unlocked;
+    if (futex.compare_exchange_strong(fut, Locked, std::memory_order_acquire,
+                                      std::memory_order_relaxed)) {
+      return;
+    }
+
+    for (;;) {
+      if (fut != Locked_With_Waiter) {
+        fut = futex.exchange(Locked_With_Waiter, std::memory_order_acquire);
+      }
+      if (fut == Unlocked) {
+        return;
+      }
+      syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, Locked_With_Waiter,
+              nullptr);
+      fut = futex.load(std::memory_order_relaxed);
+    }
+  }
+
+  void unlock() {
+    uint32_t val = futex.exchange(Unlocked, std::memory_order_release);
+    assert(val != Unlocked && "trying to unlock an already unlocked mutex");
+    if (val == Locked_With_Waiter) {
+      syscall(SYS_futex, &futex, FUTEX_WAKE_PRIVATE, 1);
+    }
+  }
+};
+
+// N independent LRU, each behind its own lock
+// A key always lands on the same shard, so the eviction is only LRU per shard
+// When the recency policy can be touched concurrently (CLOCK), a hit doesn't
+// modify the structure:
+// - with trivially copyable keys and values and flat_index, hits take no lock
+//   at all: they read the shard optimistically under a sequence lock, that
+//   the writers make odd while they modify it, and retry or fall back to the
+//   lock when a writer got in the way
+// - otherwise the lock is a reader writer one and hits only take it shared
+template <class K, class V, size_t N, class Recency = heap_recency,
+          class Index = node_index>
+class sharded_lru {
+  using lru_t = LRU<K, V, Recency, Index>;
+
+  static constexpr bool OPTIMISTIC =
+      Recency::concurrent_touch && std::is_trivially_copyable_v<K> &&
+      std::is_trivially_copyable_v<V> &&
+      requires(lru_t l, K k, lru_t::handle_t h) {
+        l.key2handle.find_racy(k, h);
+        l.h.read_racy(h, k);
+      };
+
+  using mutex_t = std::conditional_t<Recency::concurrent_touch && !OPTIMISTIC,
+                                     std::shared_mutex, futex_mutex>;
+  struct alignas(64) shard {
+    mutex_t m;
+    // Odd while a writer modifies the shard
+    std::atomic<uint64_t> seq = 0;
+    lru_t lru;
+
+    shard(size_t size) : lru(size) {}
+  };
+
+  dyn_array<shard> shards;
+
+  shard &shard_of(K k) {
+    // Not the multiplier of flat_index: the keys of a shard must not collide
+    // in its index
+    uint64_t x = uint64_t(std::hash<K>{}(k)) * 0xd6e8feb86659fd93ull;
+    return shards[size_t((__uint128_t(x) * N) >> 64)];
+  }
+
+  // Under the lock, around whatever may modify the shard
+  static V write(shard &s, auto f) {
+    if constexpr (OPTIMISTIC) {
+      uint64_t seq = s.seq.load(std::memory_order_relaxed);
+      s.seq.store(seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      V v = f();
+      s.seq.store(seq + 2, std::memory_order_release);
+      return v;
+    } else {
+      return f();
+    }
+  }
+
+  // Nothing when a writer got in the way, else the result of the lookup
+  // The reference bit is set once the read is known good: if the slot was
+  // reused since, another entry gets a second chance, which CLOCK tolerates
+  static std::optional<std::optional<V>> find_optimistic(shard &s, K k)
+    requires OPTIMISTIC
+  {
+    uint64_t seq = s.seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      return {};
+    }
+    typename lru_t::handle_t handle{};
+    std::optional<V> v;
+    if (s.lru.key2handle.find_racy(k, handle)) {
+      v = s.lru.h.read_racy(handle, k);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq) {
+      return {};
+    }
+    if (v) {
+      s.lru.h.touch(handle);
+    }
+    return v;
+  }
+
+public:
+  sharded_lru(size_t size) : shards(N) {
+    assert(size >= N);
+    for (size_t i = 0; i < N; i++) {
+      shards.emplace(size / N + (i < size % N));
+    }
+  }
+
+  // Values are returned by copy: a reference would outlive the lock
+  std::optional<V> find(K k) {
+    shard &s = shard_of(k);
+    auto lookup = [&]() -> std::optional<V> {
+      auto v = s.lru.find(k);
+      if (v) {
+        return v->get();
+      }
+      return {};
+    };
+
+    if constexpr (OPTIMISTIC) {
+      for (int attempt = 0; attempt < 4; attempt++) {
+        if (auto v = find_optimistic(s, k)) {
+          return *v;
+        }
+        _mm_pause();
+      }
+      std::lock_guard lock(s.m);
+      return lookup();
+    } else if constexpr (Recency::concurrent_touch) {
+      std::shared_lock lock(s.m);
+      return lookup();
+    } else {
+      std::lock_guard lock(s.m);
+      return lookup();
+    }
+  }
+
+  // Under every lock in turn, so not a snapshot under concurrent inserts
+  size_t size() {
+    size_t n = 0;
+    for (auto &s : shards) {
+      std::lock_guard lock(s.m);
+      n += s.lru.size();
+    }
+    return n;
+  }
+
+  V insert(K k, V v) {
+    shard &s = shard_of(k);
+    std::lock_guard lock(s.m);
+    return write(s, [&]() -> V { return s.lru.insert(k, std::move(v)); });
+  }
+
+  V find_or_insert(K k, auto Fn) {
+    if constexpr (Recency::concurrent_touch) {
+      auto v = find(k);
+      if (v) {
+        return std::move(*v);
+      }
+    }
+    shard &s = shard_of(k);
+    std::lock_guard lock(s.m);
+    return write(s, [&]() -> V { return s.lru.find_or_insert(k, Fn); });
+  }
+};
+
+template class tinylfu_admission::cache<int, std::string, list_recency,
+                                        flat_index>;
+
+template class sharded_lru<int, std::string, 4>;
+template class sharded_lru<int, std::string, 4, clock_recency, flat_index>;
+
+void test_dyn_array() {
+  // From the aligned new path to the mapped one, then grown with mremap
+  dyn_array<size_t> a(1);
+  for (size_t i = 0; i < (16 << 20) / sizeof(size_t); i++) {
+    a.push(i);
+  }
+  assert(uintptr_t(a.data()) % (2 << 20) == 0);
+  for (size_t i = 0; i < a.size(); i++) {
+    assert(a[i] == i);
+  }
+  dyn_array<size_t> moved = std::move(a);
+  assert(a.size() == 0);
+  assert(moved.size() == (16 << 20) / sizeof(size_t));
+
+  // Not trivially relocatable (too long for the small string optimization)
+  auto str = [](size_t i) {
+    return std::string(32, 'a' + i % 26) + std::to_string(i);
+  };
+  dyn_array<std::string> b(0);
+  for (size_t i = 0; i < 1000; i++) {
+    b.push(str(i));
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    assert(b[i] == str(i));
+  }
+
+  // Handles survive the growth, free slots included
+  stable_dyn_array<std::string> c(2);
+  std::vector<size_t> handles;
+  for (size_t i = 0; i < 100; i++) {
+    handles.push_back(c.emplace(str(i)));
+  }
+  for (size_t i = 0; i < 100; i += 3) {
+    c.remove(handles[i]);
+  }
+  for (size_t i = 0; i < 100; i += 3) {
+    handles[i] = c.emplace(str(i));
+  }
+  for (size_t i = 100; i < 1000; i++) {
+    handles.push_back(c.emplace(str(i)));
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    assert(c[handles[i]] == str(i));
+  }
+
+  // The heaps grow past their constructor size
+  heap<size_t> h(1);
+  quad_heap<size_t> q(1);
+  for (size_t i = 0; i < 1000; i++) {
+    h.insert(1000 - i);
+    q.insert(1000 - i);
+  }
+  for (size_t i = 1; i <= 1000; i++) {
+    assert(h.minimum() == i && q.minimum() == i);
+    h.remove_minimum();
+    q.remove_minimum();
+  }
+
+  printf("dyn_array seems to work!\n");
+}
+
+template <template <class T, class Cmp = std::less_equal<T>> class Heap>
+void test_heap(const char *name) {
+  Heap<size_t> s(5);
+  s.insert(1);
+  s.insert(3);
+  s.insert(2);
+  s.insert(0);
+  assert(s.size() == 4);
+  assert(s.minimum() == 0);
+  s.remove_minimum();
+  assert(s.size() == 3);
+  assert(s.minimum() == 1);
+  s.remove_minimum();
+  assert(s.size() == 2);
+  assert(s.minimum() == 2);
+  s.remove_minimum();
+  assert(s.size() == 1);
+  assert(s.minimum() == 3);
+  s.remove_minimum();
+  assert(s.size() == 0);
+
+  struct NewType {
+    size_t i;
+    size_t v;
+  };
+
+  auto cmp = [](const NewType &a, const NewType &b) { return a.i < b.i; };
+  Heap<NewType, decltype(cmp)> s2(2, cmp);
+  s2.insert(NewType{1, 1});
+  auto h = s2.insert(NewType{0, 2});
+  s2.update(h, [](NewType &n) {
+    assert(n.i == 0);
+    assert(n.v == 2);
+    n.i = 3;
+  });
+  assert(s2.size() == 2);
+  assert(s2.minimum().i == 1);
+  assert(s2.minimum().v == 1);
+  s2.remove_minimum();
+  assert(s2.size() == 1);
+  assert(s2.minimum().i == 3);
+  assert(s2.minimum().v == 2);
+  s2.remove_minimum();
+  assert(s2.size() == 0);
+
+  // Deep enough for every level of a 8-ary heap, with updates both ways
+  auto cmp3 = [](const NewType &a, const NewType &b) { return a.i <= b.i; };
+  Heap<NewType, decltype(cmp3)> s3(1000, cmp3);
+  dyn_array<typename Heap<NewType, decltype(cmp3)>::heap_handle> handles(1000);
+  uint64_t x = 1;
+  auto next = [&x]() {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    return x >> 33;
+  };
+  for (size_t i = 0; i < 1000; i++) {
+    handles.push(s3.insert(NewType{next() % 10000, i}));
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    auto h = handles[next() % 1000];
+    s3.update(h, [&next](NewType &n) { n.i = next() % 10000; });
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    assert(s3[handles[i]].v == i);
+  }
+  size_t last = 0;
+  while (s3.size() > 0) {
+    assert(last <= s3.minimum().i);
+    last = s3.minimum().i;
+    s3.remove_minimum();
+  }
+
+  // Bulk load, then a small batch (sifted up) and a large one (heapified)
+  using bulk_heap = Heap<NewType, decltype(cmp3)>;
+  std::vector<NewType> items;
+  for (size_t i = 0; i < 500; i++) {
+    items.push_back(NewType{next() % 10000, i});
+  }
+  bulk_heap s4(items, 1000, cmp3);
+  assert(s4.size() == 500);
+  for (size_t i = 0; i < 500; i++) {
+    assert(s4[typename bulk_heap::heap_handle{i}].v == i);
+  }
+  std::vector<typename bulk_heap::heap_handle> bulk_handles;
+  for (size_t k : {10, 490}) {
+    items.clear();
+    for (size_t i = 0; i < k; i++) {
+      items.push_back(NewType{next() % 10000, s4.size() + i});
+    }
+    bulk_handles.resize(k);
+    s4.insert_bulk(items, bulk_handles);
+    for (size_t i = 0; i < k; i++) {
+      assert(s4[bulk_handles[i]].v == s4.size() - k + i);
+    }
+  }
+  assert(s4.size() == 1000);
+  s4.update(bulk_handles[0], [](NewType &n) { n.i = 0; });
+  assert(s4.minimum().i == 0);
+  last = 0;
+  while (s4.size() > 0) {
+    assert(last <= s4.minimum().i);
+    last = s4.minimum().i;
+    s4.remove_minimum();
+  }
+
+  printf("Heap (%s) seems to work!\n", name);
+}
+
+void test_flat_index() {
+  // Few slots and a lot of churn so that erase has to shift probe chains
+  flat_index::map<unsigned int, size_t> m(8);
+  std::unordered_map<unsigned int, size_t> ref;
+  uint64_t x = 1;
+  for (size_t i = 0; i < 10000; i++) {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    unsigned int k = (x >> 33) % 24;
+    if (ref.contains(k)) {
+      assert(*m.find(k) == ref[k]);
+      m.erase(k);
+      ref.erase(k);
+    } else if (ref.size() < 8) {
+      m.insert(k, i);
+      ref.emplace(k, i);
+    }
+    for (unsigned int j = 0; j < 24; j++) {
+      size_t *h = m.find(j);
+      assert((h != nullptr) == ref.contains(j));
+      assert(!h || *h == ref[j]);
+    }
+  }
+
+  // Keys that only differ in their high bits, which only the top bits of the
+  // product mix: they must not all share a home slot
+  flat_index::map<uint64_t, size_t> high(64);
+  std::vector<bool> home(128);
+  size_t homes = 0;
+  for (uint64_t k = 0; k < 64; k++) {
+    size_t h = high.hash(k << 40);
+    homes += !home[h];
+    home[h] = true;
+  }
+  assert(homes >= 32);
+
+  printf("Flat index seems to work!\n");
+}
+
+template <class Recency, class Index> void test_lru() {
+  LRU<int, std::string, Recency, Index> lru(2);
+  {
+    auto &v = lru.find_or_insert(0, []() { return "1234"; });
+    assert(v == "1234");
+  }
+  {
+    auto &v = lru.find_or_insert(0, []() {
+      assert(false);
+      return "";
+    });
+    assert(v == "1234");
+  }
+
+  {
+    bool did_insert = false;
+    auto &v = lru.find_or_insert(1, [&did_insert]() {
+      did_insert = true;
+      return "pi";
+    });
+    assert(did_insert);
+    assert(v == "pi");
+  }
+  {
+    auto &v = lru.find_or_insert(1, []() {
+      assert(false);
+      return "";
+    });
+    assert(v == "pi");
+  }
+
+  // 0 is touched last, so inserting 2 evicts 1
+  lru.find_or_insert(0, []() { return "213"; });
+  lru.find_or_insert(2, []() { return "213"; });
+  lru.find_or_insert(0, []() {
+    assert(false);
+    return "213";
+  });
+  {
+    bool did_insert = false;
+    lru.find_or_insert(1, [&did_insert]() {
+      did_insert = true;
+      return "213";
+    });
+    assert(did_insert);
+  }
+
+  // Inserting a key again replaces its value, it is still the only entry
+  lru.insert(1, "again");
+  assert(lru.size() == 2);
+  assert(lru.find(1)->get() == "again");
+  printf("LRU (%s, %s) seems to work!\n", Recency::name, Index::name);
+}
+
+template <class Recency, class Index> void test_find_batch() {
+  LRU<int, int, Recency, Index> lru(100);
+  for (int k = 0; k < 100; k++) {
+    lru.insert(k, 2 * k);
+  }
+
+  // More than a chunk, with missing and repeated keys
+  std::array<int, 150> keys;
+  std::array<int *, 150> out;
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys[i] = int(i * 7 % 130);
+  }
+  lru.find_batch(keys, out);
+  for (size_t i = 0; i < keys.size(); i++) {
+    assert((out[i] != nullptr) == (keys[i] < 100));
+    assert(!out[i] || *out[i] == 2 * keys[i]);
+  }
+
+  // The batch touched the keys in order, the first 20 ones come back at the
+  // end: the 21st is the least recently used
+  if constexpr (!std::is_same_v<Recency, clock_recency>) {
+    lru.insert(1000, 0);
+    assert(!lru.find(keys[20]));
+  }
+
+  printf("find_batch (%s, %s) seems to work!\n", Recency::name, Index::name);
+}
+
+void test_clock() {
+  LRU<int, int, clock_recency, flat_index> lru(3);
+  lru.insert(0, 0);
+  lru.insert(1, 1);
+  lru.insert(2, 2);
+
+  // 0 and 2 get a second chance, 1 is evicted
+  assert(lru.find(0));
+  assert(lru.find(2));
+  lru.insert(3, 3);
+  assert(!lru.find(1));
+
+  // The hand cleared the bit of 0 on its way and 0 was not touched since: it
+  // goes before 2 that gets its second chance
+  lru.insert(4, 4);
+  assert(!lru.find(0));
+  assert(lru.find(2));
+  assert(lru.find(3));
+  assert(lru.find(4));
+
+  printf("CLOCK seems to work!\n");
+}
+
+// With 6 bits of timestamps, the stamps are renumbered every few dozen
+// requests, and the heap must still evict as the exact list LRU
+void test_stamp_renumbering() {
+  LRU<int, int, dary_heap_recency<4, 6>, flat_index> heap(16);
+  LRU<int, int, list_recency, flat_index> list(16);
+  uint64_t x = 1;
+  for (int i = 0; i < 10000; i++) {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    int k = int((x >> 33) % 40);
+    bool hit = bool(heap.find(k));
+    assert(hit == bool(list.find(k)));
+    if (!hit) {
+      if (heap.full()) {
+        assert(heap.victim().first == list.victim().first);
+      }
+      heap.insert(k, k);
+      list.insert(k, k);
+    }
+  }
+
+  bool thrown = false;
+  try {
+    LRU<int, int, heap4_recency, flat_index> huge((size_t(1) << 24) + 1);
+  } catch (const std::length_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  printf("Stamp renumbering seems to work!\n");
+}
+
+// victim() is exactly the entry the next insert evicts
+template <class Recency> void test_victim() {
+  LRU<int, int, Recency, flat_index> lru(16);
+  for (int k = 0; k < 16; k++) {
+    lru.insert(k, k);
+  }
+  uint64_t x = 1;
+  for (int k = 16; k < 1000; k++) {
+    for (int t = 0; t < 8; t++) {
+      x = x * 6364136223846793005ull + 1442695040888963407ull;
+      lru.find(int((x >> 33) % uint64_t(k)));
+    }
+    // Twice, it must not change what it reports
+    int v = lru.victim().first;
+    assert(lru.victim().first == v);
+    lru.insert(k, k);
+    assert(!lru.find(v));
+  }
+
+  printf("victim (%s) seems to work!\n", Recency::name);
+}
+
+template <class Recency> void test_tinylfu() {
+  tinylfu_admission::cache<int, int, Recency, flat_index> lru(100);
+
+  // A hot set, accessed often enough to be admitted in the main LRU
+  for (int r = 0; r < 10; r++) {
+    for (int k = 0; k < 50; k++) {
+      lru.find_or_insert(k, [k]() { return k; });
+    }
+  }
+  // A scan of one-off keys, they can't evict the hot set
+  for (int k = 1000; k < 1300; k++) {
+    lru.find_or_insert(k, [k]() { return k; });
+  }
+  for (int k = 0; k < 50; k++) {
+    lru.find_or_insert(k, []() {
+      assert(false);
+      return 0;
+    });
+  }
+
+  printf("TinyLFU (%s) seems to work!\n", Recency::name);
+}
+
+// A header followed by its payload
+struct message {
+  uint32_t len;
+  char payload[];
+};
+struct message_size {
+  size_t operator()(const message &m) const { return sizeof(message) + m.len; }
+};
+
+void test_byte_lru() {
+  alignas(message) char buf[1024];
+  auto msg = [&buf](uint32_t len, char c) -> message & {
+    message &m = *(message *)buf;
+    m.len = len;
+    memset(m.payload, c, len);
+    return m;
+  };
+
+  byte_lru<int, message, message_size> lru(1024, 64);
+  lru.insert(0, msg(10, 'a')); // 16B chunk
+  lru.insert(1, msg(100, 'b')); // 128B chunk
+  lru.insert(2, msg(200, 'c')); // 256B chunk
+  assert(lru.used_bytes() == 16 + 128 + 256);
+  assert(lru.find(0)->len == 10 && lru.find(0)->payload[9] == 'a');
+  assert(lru.find(1)->len == 100 && lru.find(1)->payload[99] == 'b');
+
+  lru.insert(3, msg(400, 'd')); // 512B chunk
+  assert(lru.used_bytes() == 16 + 128 + 256 + 512);
+
+  // 128B more does not fit, the least recently used goes: 2
+  lru.insert(4, msg(100, 'e'));
+  assert(!lru.find(2));
+  assert(lru.used_bytes() == 16 + 128 + 512 + 128);
+
+  // The whole budget, everything goes
+  lru.insert(5, msg(1000, 'f'));
+  assert(!lru.find(0) && !lru.find(1) && !lru.find(3) && !lru.find(4));
+  assert(lru.find(5)->payload[999] == 'f');
+  assert(lru.used_bytes() == 1024);
+
+  // Bounded by entries too
+  for (int k = 0; k < 100; k++) {
+    lru.insert(100 + k, msg(1, 'g'));
+  }
+  assert(lru.used_bytes() == 64 * 16);
+  assert(lru.find(199) && !lru.find(100));
+
+  // Inserting a key again replaces its value, and its charge
+  byte_lru<int, message, message_size> again(1024, 64);
+  again.insert(0, msg(10, 'a'));  // 16B chunk
+  again.insert(1, msg(100, 'b')); // 128B chunk
+  again.insert(0, msg(200, 'c')); // 256B chunk
+  assert(again.used_bytes() == 128 + 256);
+  assert(again.find(0)->len == 200 && again.find(0)->payload[199] == 'c');
+  assert(again.find(1)->len == 100);
+  // More than a slab of 512B chunks if the old ones leaked
+  for (int r = 0; r < 200; r++) {
+    again.insert(1, msg(400, 'd'));
+  }
+  assert(again.used_bytes() == 256 + 512);
+  assert(again.slab_bytes() == 4 * slab_arena::MIN_SLAB_SIZE);
+  // The budget is full, the replaced key is the most recent and stays
+  again.insert(1, msg(1000, 'e'));
+  assert(again.used_bytes() == 1024 && !again.find(0));
+  assert(again.find(1)->payload[999] == 'e');
+
+  // Sizes that drift through every class: the slabs of the previous classes
+  // stay, but each class stays within its bound
+  size_t budget = 1 << 20;
+  byte_lru<int, message, message_size> drift(budget, 1 << 16);
+  std::vector<char> big(slab_arena::chunk_size(1 << 16));
+  int key = 0;
+  for (size_t chunk = 16; chunk <= (1 << 16); chunk *= 2) {
+    message &m = *(message *)big.data();
+    m.len = uint32_t(chunk - sizeof(message));
+    for (size_t i = 0; i < 2 * budget / chunk + 1; i++) {
+      drift.insert(key++, m);
+    }
+    assert(drift.used_bytes() <= budget);
+  }
+  assert(drift.slab_bytes() > budget);
+  assert(drift.slab_bytes() <= slab_arena::max_slab_bytes(budget));
+
+  printf("Byte LRU seems to work!\n");
+}
+
+template <class Recency> void test_expiry() {
+  LRU<int, int, Recency, flat_index, heap_expiry> lru(4);
+  lru.insert(0, 0, 10);
+  lru.insert(1, 1);
+  lru.insert(2, 2, 20);
+  lru.insert(3, 3, 5);
+
+  // Lazily, on lookup
+  bool hit = bool(lru.find(3, 4));
+  assert(hit);
+  hit = bool(lru.find(3, 5));
+  assert(!hit);
+  assert(lru.h.size() == 3);
+
+  // The hole is filled before anything gets evicted
+  lru.insert(4, 4, 30);
+  for (int k : {0, 1, 2}) {
+    hit = bool(lru.find(k, 0));
+    assert(hit);
+  }
+
+  // In bulk, by deadline, an entry without one never expires
+  size_t expired = lru.expire(15);
+  assert(expired == 1);
+  hit = bool(lru.find(0, 15));
+  assert(!hit);
+  expired = lru.expire(100);
+  assert(expired == 2);
+  assert(lru.h.size() == 1);
+  hit = bool(lru.find(1, 1000));
+  assert(hit);
+
+  // An evicted entry takes its deadline with it: 9 reuses the entry of 5
+  lru.insert(5, 5, 40);
+  lru.insert(6, 6);
+  lru.insert(7, 7);
+  lru.insert(8, 8);
+  lru.insert(9, 9);
+  assert(!lru.key2handle.find(1) && !lru.key2handle.find(5));
+  expired = lru.expire(1000);
+  assert(expired == 0);
+  hit = bool(lru.find(9, 1000));
+  assert(hit);
+
+  printf("Expiry (%s) seems to work!\n", Recency::name);
+}
+
+void test_stack_distance() {
+  // Skewed keys: the low ones come back more often
+  uint64_t x = 1;
+  auto next = [&x]() {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    return x >> 33;
+  };
+  std::vector<unsigned int> trace;
+  for (size_t i = 0; i < 100000; i++) {
+    trace.push_back(next() % (1 + next() % 5000));
+  }
+
+  stack_distance<unsigned int> exact;
+  stack_distance<unsigned int> sampled(0.1);
+  for (auto k : trace) {
+    exact.access(k);
+    sampled.access(k);
+  }
+
+  // Exactly the misses of the LRU, within a few points when sampled
+  for (size_t lru_size : {1, 10, 100, 1000, 2500, 5000}) {
+    LRU<unsigned int, unsigned int, list_recency, flat_index> lru(lru_size);
+    uint64_t misses = 0;
+    for (auto k : trace) {
+      if (!lru.find(k)) {
+        misses++;
+        lru.insert(k, k);
+      }
+    }
+    assert(exact.misses(lru_size) == misses);
+    assert(std::abs(sampled.missrate(lru_size) -
+                    double(misses) / double(trace.size())) < 0.03);
+  }
+
+  printf("Stack distances seem to work!\n");
+}
+
+template <class Recency> void test_snapshot() {
+  using lru_t = LRU<int, int, Recency, flat_index>;
+  const char *path = "test.snapshot";
+  lru_t lru(100);
+  for (int i = 0; i < 150; i++) {
+    lru.insert(i, 2 * i);
+  }
+  for (int i = 50; i < 100; i += 2) {
+    lru.find(i);
+  }
+  bool saved = lru.save(path);
+  assert(saved);
+
+  auto evictions = [](lru_t &l) {
+    std::vector<int> order;
+    for (int i = 0; i < 100; i++) {
+      order.push_back(l.victim().first);
+      l.insert(1000 + i, 0);
+    }
+    return order;
+  };
+
+  // Twice: the first reopened cache must not have modified the file
+  std::vector<int> orders[2];
+  for (auto &order : orders) {
+    auto reopened = lru_t::open(path);
+    assert(reopened);
+    assert(reopened->full());
+    for (int i = 0; i < 150; i++) {
+      auto handle = reopened->key2handle.find(i);
+      assert(bool(handle) == (i >= 50));
+      assert(!handle || reopened->h[*handle].v == 2 * i);
+    }
+    order = evictions(*reopened);
+  }
+  auto order = evictions(lru);
+  assert(orders[0] == order && orders[1] == order);
+
+  assert(!(LRU<int, long, Recency, flat_index>::open(path)));
+
+  // Corrupt sections: more items than their bytes hold, another item size,
+  // then a truncated file
+  snapshot_header header;
+  int fd = ::open(path, O_RDWR);
+  ssize_t n = pread(fd, &header, sizeof(header), 0);
+  assert(n == sizeof(header));
+  off_t table = sizeof(header) + header.values_bytes;
+  snapshot_section section;
+  n = pread(fd, &section, sizeof(section), table);
+  assert(n == sizeof(section));
+  for (auto [capacity, item_size] :
+       {std::pair{section.bytes / section.item_size + 1, section.item_size},
+        std::pair{section.capacity, section.item_size + 1}}) {
+    snapshot_section corrupt = section;
+    corrupt.capacity = capacity;
+    corrupt.item_size = item_size;
+    n = pwrite(fd, &corrupt, sizeof(corrupt), table);
+    assert(n == sizeof(corrupt));
+    assert(!lru_t::open(path));
+  }
+  n = pwrite(fd, &section, sizeof(section), table);
+  assert(n == sizeof(section));
+  assert(lru_t::open(path));
+  struct stat st;
+  fstat(fd, &st);
+  int truncated = ftruncate(fd, st.st_size / 2);
+  assert(truncated == 0);
+  close(fd);
+  assert(!lru_t::open(path));
+
+  unlink(path);
+  assert(!lru_t::open(path));
+
+  printf("Snapshot (%s) seems to work!\n", Recency::name);
+}
+
+template <class Recency> void test_sharded_lru() {
+  sharded_lru<int, int, 4, Recency, flat_index> lru(64);
+  for (int k = 0; k < 64; k++) {
+    assert(lru.find_or_insert(k, [k]() { return 2 * k; }) == 2 * k);
+  }
+
+  assert(lru.size() <= 64);
+
+  // Every thread agrees on the value of a key, whoever inserted it
+  std::array<std::thread, 4> threads;
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t] = std::thread([&lru, t]() {
+      for (int i = 0; i < 10000; i++) {
+        int k = (i * 7 + int(t)) % 256;
+        assert(lru.find_or_insert(k, [k]() { return 2 * k; }) == 2 * k);
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+
+  // Two words that must always be read together, while the writers keep
+  // replacing the entries under the optimistic readers
+  struct pair {
+    uint64_t k, not_k;
+  };
+  // Room for every key: a key inserted again must replace its entry, not
+  // add a second one
+  sharded_lru<int, pair, 2, Recency, flat_index> pairs(128);
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t] = std::thread([&pairs, t]() {
+      for (int i = 0; i < 100000; i++) {
+        int k = (i * 7 + int(t)) % 32;
+        auto p = pairs.find(k);
+        assert(!p || (p->k == uint64_t(k) && p->not_k == ~uint64_t(k)));
+        if (t % 2 == 0) {
+          pairs.insert(k, pair{uint64_t(k), ~uint64_t(k)});
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  assert(pairs.size() == 32);
+  for (int k = 0; k < 32; k++) {
+    auto p = pairs.find(k);
+    assert(p && p->k == uint64_t(k));
+  }
+
+  printf("Sharded LRU (%s) seems to work!\n", Recency::name);
+}
+
+void blackbox(auto &r) { __asm__ volatile("" : "+g"(r) : :); }
+
+int do_bench(auto &lru, std::span<unsigned int> data) {
+  int misses = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    auto k = data[i];
+
+    auto u = lru.find(k);
+    int v;
+    if (u) {
+      v = u.value();
+    } else {
+      misses += 1;
+      v = lru.insert(k, 0);
+    }
+    blackbox(v);
+  }
+  return misses;
+}
+
+// The request index is the clock: a miss gets a deadline ttl requests later,
+// and the past deadlines are expired every 64 requests
+int do_bench_expiry(auto &lru, std::span<unsigned int> data, uint64_t ttl) {
+  int misses = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    auto k = data[i];
+    if (i % 64 == 0) {
+      lru.expire(i);
+    }
+
+    auto u = lru.find(k, i);
+    int v;
+    if (u) {
+      v = u.value();
+    } else {
+      misses += 1;
+      v = lru.insert(k, 0, i + ttl);
+    }
+    blackbox(v);
+  }
+  return misses;
+}
+
+struct rng_lehmer64 {
+  __uint128_t g_lehmer64_state;
+  rng_lehmer64(uint64_t seed) : g_lehmer64_state(seed) {}
+
+  uint64_t operator()() {
+    g_lehmer64_state *= 0xda942042e4dd58b5;
+    return g_lehmer64_state >> 64;
+  }
+};
+
+enum class workload { uniform, zipf, scan };
+
+const char *workload_name(workload w) {
+  switch (w) {
+  case workload::uniform:
+    return "uniform";
+  case workload::zipf:
+    return "zipf";
+  case workload::scan:
+    return "scan";
+  }
+  return "";
+}
+
+// uniform: rng() % item_count
+// zipf: key i is drawn with a probability proportional to 1 / (i + 1)^0.99
+// scan: the zipf stream, but 2000 out of every 10000 accesses are a
+// sequential scan over keys that are never seen again
+struct key_stream {
+  workload w;
+  size_t item_count;
+  rng_lehmer64 rng;
+  std::vector<double> cdf;
+  size_t i = 0;
+  unsigned int next_scan_key;
+
+  key_stream(workload w, size_t item_count, uint64_t seed)
+      : w(w), item_count(item_count), rng(seed), next_scan_key(item_count) {
+    if (w == workload::uniform) {
+      return;
+    }
+    cdf.reserve(item_count);
+    double sum = 0;
+    for (size_t k = 0; k < item_count; k++) {
+      sum += 1.0 / std::pow(double(k + 1), 0.99);
+      cdf.push_back(sum);
+    }
+    for (auto &c : cdf) {
+      c /= sum;
+    }
+  }
+
+  unsigned int operator()() {
+    i++;
+    switch (w) {
+    case workload::uniform:
+      return rng() % item_count;
+    case workload::scan:
+      if (i % 10000 < 2000) {
+        return next_scan_key++;
+      }
+      [[fallthrough]];
+    case workload::zipf: {
+      double u = double(rng() >> 11) * 0x1.0p-53;
+      return std::min(size_t(std::lower_bound(cdf.begin(), cdf.end(), u) -
+                             cdf.begin()),
+                      item_count - 1);
+    }
+    }
+    return 0;
+  }
+};
+
+#define printf(...)
+
+struct bench_lru_res {
+  int msec;
+  float ns_per_op;
+  int misses;
+  float missrate;
+};
+
+// With deadlines, entries live 4 times the cache size in requests
+template <class Recency, class Index, class Admission = no_admission,
+          class Expiry = no_expiry>
+bench_lru_res bench_lru(workload w, size_t item_count, size_t lru_size,
+                        size_t iter_count, bool prefill) {
+  constexpr bool expiry = !std::is_same_v<Expiry, no_expiry>;
+  static_assert(!expiry || std::is_same_v<Admission, no_admission>);
+  std::conditional_t<
+      expiry, LRU<unsigned int, unsigned int, Recency, Index, Expiry>,
+      typename Admission::template cache<unsigned int, unsigned int, Recency,
+                                         Index>>
+      lru(lru_size);
+
+  dyn_array<unsigned int> data(iter_count);
+  {
     printf("generating random data...\n");
     auto before = std::chrono::steady_clock::now();
     size_t size = 0;
-    rng_lehmer64 rng(6);
+    key_stream keys(w, item_count, 6);
     for (size_t i = 0; i < iter_count; i++) {
-      unsigned int k = rng() % item_count;
+      unsigned int k = keys();
       data.push(k);
       if (prefill) {
         lru.find_or_insert(k, []() { return 0; });
@@ -526,45 +3292,589 @@ std::pair<int, float> bench_lru(size_t item_count, size_t lru_size,
          expected > 1.0 ? 1.0 : expected);
 
   auto before = std::chrono::steady_clock::now();
-  auto miss = do_bench(lru, data);
-  int msec = std::chrono::duration_cast<std::chrono::milliseconds>(
-                 std::chrono::steady_clock::now() - before)
-                 .count();
+  int miss;
+  if constexpr (expiry) {
+    miss = do_bench_expiry(lru, data, 4 * lru_size);
+  } else {
+    miss = do_bench(lru, data);
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - before)
+                .count();
+  int msec = int(ns / 1'000'000);
 
   printf("Took %dms\n", msec);
-  return {msec, float(miss) / float(iter_count)};
+  return {msec, float(ns) / float(iter_count), miss,
+          float(miss) / float(iter_count)};
 }
 
-int main(int argc, char *argv[]) {
-  test_heap();
-  test_lru();
+struct bench_lru_mt_res {
+  float ops_per_sec;
+  float missrate;
+  float fairness;
+  // Of the slowest thread
+  float p99_ns;
+};
 
-  // np.logspace(1, 4, 10)
-  std::array item_counts{16384};
-  std::array lru_sizes{2,    4,     8,     16,    32,    64,    128,  256,
-                       512,  1024,  1184,  1371,  1586,  1835,  2124, 2457,
-                       2843, 3290,  3807,  4406,  5098,  5899,  6826, 7898,
-                       9139, 10575, 12236, 14159, 16384, 18000, 20000};
+// Every thread replays its own stream of keys on the shared cache, in a loop
+// for duration_ms, one timed request per call of bench_mt
+template <size_t N, class Recency>
+bench_lru_mt_res bench_lru_mt(size_t item_count, size_t lru_size,
+                              size_t iter_count, size_t thread_count,
+                              size_t duration_ms) {
+  sharded_lru<unsigned int, unsigned int, N, Recency, flat_index> lru(lru_size);
 
-  std::array iter_counts{100,   3252,  6405,  9557,  12710, 15863, 19015,
-                         22168, 25321, 28473, 31626, 34778, 37931, 41084,
-                         44236, 47389, 50542, 53694, 56847, 60000, 100000};
+  struct alignas(64) stream {
+    dyn_array<unsigned int> keys;
+    size_t next = 0;
+    size_t misses = 0;
 
-  auto f = fopen("out.csv", "w");
-  fprintf(f, "iter_count;item_count;lru_size;time;missrate\n");
-  bool prefill = false;
+    stream(size_t size) : keys(size) {}
+  };
+  std::vector<stream> streams;
+  for (size_t t = 0; t < thread_count; t++) {
+    streams.emplace_back(iter_count);
+    rng_lehmer64 rng(6 + 2 * t);
+    for (size_t i = 0; i < iter_count; i++) {
+      streams[t].keys.push(rng() % item_count);
+    }
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "sharded_lru (%s, %zu shards)", Recency::name,
+           N);
+  auto r = bench_mt(name, thread_count, duration_ms, [&](size_t t) {
+    stream &s = streams[t];
+    s.misses += do_bench(lru, std::span(&s.keys[s.next], 1));
+    s.next = s.next + 1 == iter_count ? 0 : s.next + 1;
+  });
+
+  size_t ops = 0;
+  size_t misses = 0;
+  float p99 = 0;
+  for (size_t t = 0; t < thread_count; t++) {
+    ops += r.threads[t].ops;
+    misses += streams[t].misses;
+    p99 = MAX(p99, r.threads[t].hist.percentile(0.99f));
+  }
+  return {r.ops_per_sec, float(misses) / float(ops), r.fairness,
+          p99 * nano_per_cycle};
+}
+
+struct bench_batch_res {
+  float scalar_ns;
+  float batch_ns;
+};
+
+// Lookups only, on a full cache: every key hits
+template <class Recency, class Index>
+bench_batch_res bench_batch(size_t lru_size, size_t iter_count) {
+  LRU<unsigned int, unsigned int, Recency, Index> lru(lru_size);
+  for (size_t k = 0; k < lru_size; k++) {
+    lru.insert(k, k);
+  }
+
+  dyn_array<unsigned int> data(iter_count);
+  rng_lehmer64 rng(6);
+  for (size_t i = 0; i < iter_count; i++) {
+    data.push(rng() % lru_size);
+  }
+
+  auto before = std::chrono::steady_clock::now();
+  for (auto k : data) {
+    auto v = lru.find(k).value().get();
+    blackbox(v);
+  }
+  auto scalar_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - before)
+                       .count();
+
+  // The typical request
+  constexpr size_t BATCH = 32;
+  std::array<unsigned int *, BATCH> out;
+  before = std::chrono::steady_clock::now();
+  for (size_t i = 0; i + BATCH <= iter_count; i += BATCH) {
+    lru.find_batch(std::span(data.begin() + i, BATCH), out);
+    for (auto v : out) {
+      blackbox(*v);
+    }
+  }
+  auto batch_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - before)
+                      .count();
+
+  return {float(scalar_ns) / float(iter_count),
+          float(batch_ns) / float(iter_count / BATCH * BATCH)};
+}
+
+struct bench_byte_lru_res {
+  float ns_per_op;
+  float missrate;
+  size_t used_bytes;
+  size_t slab_bytes;
+};
+
+// Zipf keys, the value of a key spans from 16B to 64KiB, log uniformly
+bench_byte_lru_res bench_byte_lru(size_t budget, size_t item_count,
+                                  size_t iter_count) {
+  byte_lru<unsigned int, message, message_size> lru(budget, item_count);
+
+  dyn_array<unsigned int> data(iter_count);
+  key_stream keys(workload::zipf, item_count, 6);
+  for (size_t i = 0; i < iter_count; i++) {
+    data.push(keys());
+  }
+
+  auto value_size = [](unsigned int k) -> uint32_t {
+    uint64_t x = uint64_t(k) * 0x9e3779b97f4a7c15ull;
+    uint32_t shift = 4 + (x >> 32) % 13;
+    uint32_t size = (1u << shift) + (x >> 48) % (1u << shift);
+    return MAX(MIN(size, 1u << 16), uint32_t(sizeof(message))) -
+           sizeof(message);
+  };
+  alignas(message) static char buf[1 << 16];
+  message &m = *(message *)buf;
+
+  int misses = 0;
+  auto before = std::chrono::steady_clock::now();
+  for (auto k : data) {
+    message *v = lru.find(k);
+    if (!v) {
+      misses++;
+      m.len = value_size(k);
+      v = lru.insert(k, m);
+    }
+    blackbox(v);
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - before)
+                .count();
+
+  return {float(ns) / float(iter_count), float(misses) / float(iter_count),
+          lru.used_bytes(), lru.slab_bytes()};
+}
+
+// np.logspace(1, 4, 10)
+constexpr std::array item_counts{16384};
+constexpr std::array lru_sizes{
+    2,    4,    8,    16,   32,   64,    128,   256,   512,   1024,  1184,
+    1371, 1586, 1835, 2124, 2457, 2843,  3290,  3807,  4406,  5098,  5899,
+    6826, 7898, 9139, 10575, 12236, 14159, 16384, 18000, 20000};
+
+constexpr std::array iter_counts{
+    100,   3252,  6405,  9557,  12710, 15863, 19015, 22168, 25321, 28473, 31626,
+    34778, 37931, 41084, 44236, 47389, 50542, 53694, 56847, 60000, 100000};
+
+template <class Recency, class Index, class Admission = no_admission,
+          class Expiry = no_expiry>
+void sweep(FILE *f, workload w, bool prefill) {
   for (auto item_count : item_counts) {
     for (auto lru_size : lru_sizes) {
       for (auto iter_count : iter_counts) {
-        printf("iter_count: %d, item_count:  %d, lru_size: %d\n", iter_count,
-               item_count, lru_size);
-        auto [t, missrate] =
-            bench_lru(item_count, lru_size, iter_count, prefill);
-        fprintf(f, "%d;%d;%d;%d;%f\n", iter_count, item_count, lru_size, t,
-                missrate);
+        printf("workload: %s, recency: %s, index: %s, admission: %s, "
+               "expiry: %s, iter_count: %d, item_count:  %d, lru_size: %d\n",
+               workload_name(w), Recency::name, Index::name, Admission::name,
+               Expiry::name, iter_count, item_count, lru_size);
+        auto r = bench_lru<Recency, Index, Admission, Expiry>(
+            w, item_count, lru_size, iter_count, prefill);
+        fprintf(f, "%s;%s;%s;%s;%s;%d;%d;%d;%d;%f;%d;%f\n", workload_name(w),
+                Recency::name, Index::name, Admission::name, Expiry::name,
+                iter_count, item_count, lru_size, r.msec, r.ns_per_op,
+                r.misses, r.missrate);
+      }
+    }
+  }
+}
+
+void out_csv_header(FILE *f) {
+  fprintf(f, "workload;recency;index;admission;expiry;iter_count;item_count;"
+             "lru_size;time;ns_per_op;misses;missrate\n");
+}
+
+// The rows of sweep() in one pass per item_count: the streams have the same
+// seed, a shorter iter_count is a prefix of the longer ones
+// The recency column is "mrc", the index one the method (exact or shards)
+void mrc_sweep(FILE *f, workload w, double rate) {
+  const char *method = rate < 1.0 ? "shards" : "exact";
+  for (auto item_count : item_counts) {
+    dyn_array<unsigned int> data(iter_counts.back());
+    key_stream keys(w, item_count, 6);
+    for (size_t i = 0; i < data.capacity(); i++) {
+      data.push(keys());
+    }
+
+    stack_distance<unsigned int> sd(rate);
+    size_t ns = 0;
+    for (auto iter_count : iter_counts) {
+      auto before = std::chrono::steady_clock::now();
+      while (sd.access_count() < size_t(iter_count)) {
+        sd.access(data[sd.access_count()]);
+      }
+      ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - before)
+                .count();
+
+      for (auto lru_size : lru_sizes) {
+        fprintf(f, "%s;mrc;%s;none;none;%d;%d;%d;%d;%f;%d;%f\n",
+                workload_name(w), method, iter_count, item_count, lru_size,
+                int(ns / 1'000'000), float(ns) / float(iter_count),
+                int(sd.misses(lru_size)), sd.missrate(lru_size));
+      }
+    }
+  }
+}
+
+// A trace has one key per line, the sizes go by powers of two up to the
+// number of distinct keys
+void mrc_trace(FILE *f, FILE *in, const char *path, double rate) {
+  stack_distance<uint64_t> sd(rate);
+  unsigned long long k;
+  auto before = std::chrono::steady_clock::now();
+  while (fscanf(in, "%llu", &k) == 1) {
+    sd.access(k);
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - before)
+                .count();
+
+  const char *method = rate < 1.0 ? "shards" : "exact";
+  size_t n = sd.access_count();
+  for (size_t lru_size = 1;; lru_size <<= 1) {
+    fprintf(f, "%s;mrc;%s;none;none;%zu;%zu;%zu;%d;%f;%zu;%f\n", path,
+            method, n, size_t(sd.key_count()), lru_size,
+            int(ns / 1'000'000), float(ns) / float(MAX(n, size_t(1))),
+            size_t(sd.misses(lru_size)), sd.missrate(lru_size));
+    if (lru_size >= sd.key_count()) {
+      break;
+    }
+  }
+}
+
+// Warms a cache on a zipf stream and saves it, then replays the rest of the
+// stream on the reopened snapshot and on an empty cache
+// Every window of requests after the restart gets its miss rate and time
+template <class Recency> void bench_restart(FILE *f) {
+  const size_t item_count = 1 << 22;
+  const size_t lru_size = 1 << 18;
+  const size_t warmup_count = 4'000'000;
+  const size_t iter_count = 2'000'000;
+  const size_t window = 100'000;
+  const char *path = "lru.snapshot";
+  using lru_t = LRU<unsigned int, unsigned int, Recency, flat_index>;
+
+  key_stream keys(workload::zipf, item_count, 6);
+  {
+    lru_t lru(lru_size);
+    for (size_t i = 0; i < warmup_count; i++) {
+      unsigned int k = keys();
+      if (!lru.find(k)) {
+        lru.insert(k, k);
+      }
+    }
+    bool saved = lru.save(path);
+    assert(saved);
+  }
+  dyn_array<unsigned int> data(iter_count);
+  for (size_t i = 0; i < iter_count; i++) {
+    data.push(keys());
+  }
+
+  for (bool warm : {true, false}) {
+    auto before = std::chrono::steady_clock::now();
+    auto lru = warm ? lru_t::open(path)
+                    : std::optional<lru_t>(std::in_place, lru_size);
+    assert(lru);
+    auto open_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - before)
+                       .count();
+
+    size_t misses = 0;
+    before = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iter_count; i++) {
+      if (!lru->find(data[i])) {
+        misses++;
+        lru->insert(data[i], data[i]);
+      }
+      if ((i + 1) % window == 0) {
+        auto now = std::chrono::steady_clock::now();
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      now - before)
+                      .count();
+        fprintf(f, "%s;%s;%f;%zu;%f;%f\n", Recency::name,
+                warm ? "snapshot" : "cold", float(open_ns) / 1000, i + 1,
+                float(misses) / float(window), float(ns) / float(window));
+        misses = 0;
+        before = now;
+      }
+    }
+  }
+  unlink(path);
+}
+
+struct bench_push_res {
+  float dyn_array_ns;
+  float vector_ns;
+};
+
+// Pushes n items in an empty array, both growing from scratch
+// Past 2MiB, dyn_array moves its pages with mremap while std::vector copies
+template <class T> bench_push_res bench_push(size_t n) {
+  size_t reps = MAX(size_t(1), (size_t(1) << 24) / n);
+
+  auto before = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < reps; r++) {
+    dyn_array<T> a(0);
+    for (size_t i = 0; i < n; i++) {
+      a.push(T{i});
+    }
+    T *last = &a[n - 1];
+    blackbox(last);
+  }
+  auto dyn_array_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - before)
+                          .count();
+
+  before = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < reps; r++) {
+    std::vector<T> v;
+    for (size_t i = 0; i < n; i++) {
+      v.push_back(T{i});
+    }
+    T *last = &v[n - 1];
+    blackbox(last);
+  }
+  auto vector_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - before)
+                       .count();
+
+  return {float(dyn_array_ns) / float(n * reps),
+          float(vector_ns) / float(n * reps)};
+}
+
+struct cache_line {
+  size_t v[8];
+};
+
+template <class T> void sweep_push(FILE *f, const char *name) {
+  for (size_t n = 1 << 10; n <= 1 << 25; n <<= 3) {
+    auto r = bench_push<T>(n);
+    fprintf(f, "%s;%zu;%f;%f;%f\n", name, n, r.dyn_array_ns, r.vector_ns,
+            r.vector_ns / r.dyn_array_ns);
+  }
+}
+
+struct bench_heapify_res {
+  float insert_ns;
+  float bulk_ns;
+};
+
+// Rebuilds a heap of n timers, one insert at a time then in bulk
+// Random deadlines sift up by less than two levels on average, descending ones
+// all go up to the root, the worst case for one insert at a time
+template <template <class T, class Cmp = std::less_equal<T>> class Heap>
+bench_heapify_res bench_heapify(size_t n, bool descending) {
+  std::vector<uint64_t> deadlines(n);
+  rng_lehmer64 rng(6);
+  for (auto &d : deadlines) {
+    d = rng();
+  }
+  if (descending) {
+    std::sort(deadlines.begin(), deadlines.end(), std::greater<uint64_t>());
+  }
+
+  auto before = std::chrono::steady_clock::now();
+  {
+    Heap<uint64_t> h(n);
+    for (auto d : deadlines) {
+      h.insert(std::move(d));
+    }
+    blackbox(h.minimum());
+  }
+  auto insert_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now() - before)
+                       .count();
+
+  before = std::chrono::steady_clock::now();
+  {
+    Heap<uint64_t> h(deadlines);
+    blackbox(h.minimum());
+  }
+  auto bulk_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - before)
+                     .count();
+
+  return {float(insert_ns) / float(n), float(bulk_ns) / float(n)};
+}
+
+template <template <class T, class Cmp = std::less_equal<T>> class Heap>
+void sweep_heapify(FILE *f, const char *name) {
+  for (bool descending : {false, true}) {
+    for (size_t n = 1 << 16; n <= 1 << 22; n <<= 2) {
+      auto r = bench_heapify<Heap>(n, descending);
+      fprintf(f, "%s;%s;%zu;%f;%f;%f\n", name,
+              descending ? "descending" : "random", n, r.insert_ns, r.bulk_ns,
+              r.insert_ns / r.bulk_ns);
+    }
+  }
+}
+
+// From 1MiB of index to well past the L2 and the L3
+template <class Recency, class Index> void sweep_batch(FILE *f) {
+  const size_t iter_count = 1'000'000;
+  for (size_t lru_size = 1 << 15; lru_size <= 1 << 21; lru_size <<= 1) {
+    auto r = bench_batch<Recency, Index>(lru_size, iter_count);
+    fprintf(f, "%s;%s;%zu;%f;%f;%f\n", Recency::name, Index::name, lru_size,
+            r.scalar_ns, r.batch_ns, r.scalar_ns / r.batch_ns);
+  }
+}
+
+template <size_t N, class Recency> void sweep_mt(FILE *f) {
+  const size_t item_count = 16384;
+  const size_t lru_size = 8192;
+  const size_t iter_count = 1'000'000;
+  const size_t duration_ms = 500;
+  size_t max_threads = MAX(std::thread::hardware_concurrency(), 1u);
+  for (size_t thread_count = 1; thread_count <= max_threads; thread_count++) {
+    auto r = bench_lru_mt<N, Recency>(item_count, lru_size, iter_count,
+                                      thread_count, duration_ms);
+    fprintf(f, "%s;%zu;%zu;%f;%f;%f;%f\n", Recency::name, N, thread_count,
+            r.ops_per_sec, r.missrate, r.fairness, r.p99_ns);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  test_dyn_array();
+  test_heap<heap>("binary");
+  test_heap<quad_heap>("4-ary");
+  test_heap<oct_heap>("8-ary");
+  test_flat_index();
+  test_lru<heap_recency, node_index>();
+  test_lru<list_recency, node_index>();
+  test_lru<heap_recency, flat_index>();
+  test_lru<list_recency, flat_index>();
+  test_lru<heap4_recency, flat_index>();
+  test_find_batch<heap4_recency, flat_index>();
+  test_find_batch<heap_recency, node_index>();
+  test_find_batch<list_recency, flat_index>();
+  test_find_batch<clock_recency, flat_index>();
+  test_clock();
+  test_stamp_renumbering();
+  test_victim<list_recency>();
+  test_victim<heap_recency>();
+  test_victim<clock_recency>();
+  test_tinylfu<list_recency>();
+  test_tinylfu<clock_recency>();
+  test_byte_lru();
+  test_expiry<heap_recency>();
+  test_expiry<heap4_recency>();
+  test_expiry<list_recency>();
+  test_stack_distance();
+  test_snapshot<heap_recency>();
+  test_snapshot<heap4_recency>();
+  test_snapshot<list_recency>();
+  test_snapshot<clock_recency>();
+  test_sharded_lru<list_recency>();
+  test_sharded_lru<clock_recency>();
+
+  // ./lru mrc <uniform|zipf|scan|trace file> [sampling rate]
+  // Only the miss rate curve, from the stack distances, in out.csv
+  if (argc > 2 && strcmp(argv[1], "mrc") == 0) {
+    double rate = argc > 3 ? atof(argv[3]) : 1.0;
+    if (!(rate > 0 && rate <= 1.0)) {
+      fprintf(stderr, "the sampling rate goes from 0 (excluded) to 1\n");
+      return 1;
+    }
+    std::optional<workload> w;
+    for (auto candidate : {workload::uniform, workload::zipf, workload::scan}) {
+      if (strcmp(argv[2], workload_name(candidate)) == 0) {
+        w = candidate;
       }
     }
+    FILE *in = nullptr;
+    if (!w && !(in = fopen(argv[2], "r"))) {
+      fprintf(stderr, "can't read %s\n", argv[2]);
+      return 1;
+    }
+
+    auto f = fopen("out.csv", "w");
+    out_csv_header(f);
+    if (w) {
+      mrc_sweep(f, *w, rate);
+    } else {
+      mrc_trace(f, in, argv[2], rate);
+      fclose(in);
+    }
+    fclose(f);
+    return 0;
+  }
+
+  auto f = fopen("out.csv", "w");
+  out_csv_header(f);
+  bool prefill = false;
+  sweep<heap_recency, node_index>(f, workload::uniform, prefill);
+  sweep<list_recency, node_index>(f, workload::uniform, prefill);
+  sweep<heap_recency, flat_index>(f, workload::uniform, prefill);
+  sweep<list_recency, flat_index>(f, workload::uniform, prefill);
+  sweep<heap4_recency, flat_index>(f, workload::uniform, prefill);
+  sweep<heap8_recency, flat_index>(f, workload::uniform, prefill);
+  sweep<clock_recency, flat_index>(f, workload::uniform, prefill);
+  // The cost of the second heap ordering the deadlines
+  sweep<heap_recency, flat_index, no_admission, heap_expiry>(
+      f, workload::uniform, prefill);
+  sweep<list_recency, flat_index, no_admission, heap_expiry>(
+      f, workload::uniform, prefill);
+  for (auto w : {workload::uniform, workload::zipf, workload::scan}) {
+    if (w != workload::uniform) {
+      sweep<list_recency, flat_index>(f, w, prefill);
+      sweep<clock_recency, flat_index>(f, w, prefill);
+    }
+    sweep<list_recency, flat_index, tinylfu_admission>(f, w, prefill);
+  }
+  fclose(f);
+
+  f = fopen("out_batch.csv", "w");
+  fprintf(f, "recency;index;lru_size;scalar_ns;batch_ns;speedup\n");
+  sweep_batch<heap_recency, flat_index>(f);
+  sweep_batch<heap4_recency, flat_index>(f);
+  sweep_batch<list_recency, flat_index>(f);
+  sweep_batch<clock_recency, flat_index>(f);
+  fclose(f);
+
+  f = fopen("out_bytes.csv", "w");
+  fprintf(f, "budget;ns_per_op;missrate;used_bytes;slab_bytes\n");
+  for (size_t budget : {8 << 20, 32 << 20, 128 << 20}) {
+    auto r = bench_byte_lru(budget, 65536, 1'000'000);
+    fprintf(f, "%zu;%f;%f;%zu;%zu\n", budget, r.ns_per_op, r.missrate,
+            r.used_bytes, r.slab_bytes);
   }
   fclose(f);
+
+  f = fopen("out_restart.csv", "w");
+  fprintf(f, "recency;start;open_us;requests;missrate;ns_per_op\n");
+  bench_restart<list_recency>(f);
+  bench_restart<heap_recency>(f);
+  fclose(f);
+
+  f = fopen("out_push.csv", "w");
+  fprintf(f, "type;n;dyn_array_ns;vector_ns;speedup\n");
+  sweep_push<size_t>(f, "size_t");
+  sweep_push<cache_line>(f, "cache_line");
+  fclose(f);
+
+  f = fopen("out_heapify.csv", "w");
+  fprintf(f, "heap;order;n;insert_ns;bulk_ns;speedup\n");
+  sweep_heapify<heap>(f, "binary");
+  sweep_heapify<quad_heap>(f, "4-ary");
+  sweep_heapify<oct_heap>(f, "8-ary");
+  fclose(f);
+
+  // A single shard is a global lock
+  compute_bias();
+  f = fopen("out_mt.csv", "w");
+  fprintf(f, "recency;shards;threads;ops_per_sec;missrate;fairness;p99_ns\n");
+  sweep_mt<1, list_recency>(f);
+  sweep_mt<16, list_recency>(f);
+  sweep_mt<16, clock_recency>(f);
+  fclose(f);
   return 0;
 }
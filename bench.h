@@ -1,11 +1,27 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cpuid.h>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <functional>
+#include <linux/perf_event.h>
+#include <map>
+#include <pthread.h>
+#include <random>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
 
 #define NO_INLINE __attribute__((noinline))
 inline void blackbox() { asm volatile(""); }
@@ -27,103 +43,937 @@ inline uint64_t rdtsc() {
   return ((uint64_t)lo) | (((uint64_t)hi) << 32);
 }
 
+/// Welford's running mean and variance of the samples, in cycles
+/// A sample more than 3 sigmas away from the mean is an outlier and skipped
+struct sample_stats {
+  float mean = 0;
+  float m2 = 0;
+  float count = 0;
+  size_t outlier = 0;
+
+  void add(float x) {
+    if (count >= 2 && fabs((x - mean) / sqrt(m2 / (count - 1))) > 3.0) {
+      // outlier!, skip it
+      outlier += 1;
+      return;
+    }
+
+    count += 1;
+    float mean_next = mean + (x - mean) / count;
+    float m2_next = m2 + (x - mean) * (x - mean_next);
+
+    m2 = m2_next;
+    mean = mean_next;
+  }
+
+  float var() const { return m2 / (count - 1); }
+};
+
+/// Start of a timed region: the first lfence keeps rdtsc from running before
+/// the previous instructions are done, the second keeps the region from
+/// starting before rdtsc
+inline uint64_t rdtsc_begin() {
+  uint64_t hi, lo;
+  __asm__ volatile("lfence\n\trdtsc\n\tlfence"
+                   : "=a"(lo), "=d"(hi)
+                   :
+                   : "memory");
+  return ((uint64_t)lo) | (((uint64_t)hi) << 32);
+}
+
+/// End of a timed region: rdtscp waits for the region to be done, lfence
+/// keeps what follows from starting before it
+inline uint64_t rdtsc_end() {
+  uint64_t hi, lo, aux;
+  __asm__ volatile("rdtscp\n\tlfence"
+                   : "=a"(lo), "=d"(hi), "=c"(aux)
+                   :
+                   : "memory");
+  return ((uint64_t)lo) | (((uint64_t)hi) << 32);
+}
+
+/// Half width of the 95% confidence interval of bias
+static float bias_ci = 0;
+/// Whether the tsc ticks at a constant rate whatever the frequency and
+/// power state of the core, without it the ns figures can't be trusted
+static bool invariant_tsc = false;
+
+static bool has_invariant_tsc() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return edx & (1u << 8);
+}
+
+/// A reading of CLOCK_MONOTONIC_RAW with the tsc at the same time, the
+/// tightest of a few rdtsc brackets around clock_gettime
+struct clock_sample {
+  double ns;
+  double cycles;
+};
+
+static clock_sample sample_clock() {
+  clock_sample best{0, 0};
+  uint64_t best_width = UINT64_MAX;
+  for (size_t i = 0; i < 16; i++) {
+    struct timespec t = {0, 0};
+    uint64_t before = rdtsc_begin();
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    uint64_t after = rdtsc_end();
+
+    if (after - before < best_width) {
+      best_width = after - before;
+      best = {(double)t.tv_sec * 1e9 + (double)t.tv_nsec,
+              (double)before + (double)(after - before) / 2};
+    }
+  }
+  return best;
+}
+
 /// compute the time added by the sequence
-/// a = RDTSC()
-/// fences()
-/// fences()
-/// b = RDTSC()
-///
-/// ~40 cycles on my machine (due to fences?!)
+/// a = rdtsc_begin()
+/// b = rdtsc_end()
+/// and the length of a cycle: the slope of a least squares fit of
+/// CLOCK_MONOTONIC_RAW against the tsc over several windows, so that a
+/// window crossing a second, or a slow one, doesn't skew it
 static void compute_bias() {
   size_t RETRY = 1'000'000;
   printf("computing bias and timings\n");
 
-  struct timespec tstart = {0, 0}, tend = {0, 0};
-  clock_gettime(CLOCK_MONOTONIC, &tstart);
-  uint64_t rstart = rdtsc();
+  invariant_tsc = has_invariant_tsc();
+  if (!invariant_tsc) {
+    printf("warning: the tsc is not invariant, ns are not reliable\n");
+  }
+
   {
-    uint64_t sum = 0;
+    sample_stats stats;
+    for (size_t i = 0; i < RETRY; i++) {
+      uint64_t begining = rdtsc_begin();
+      uint64_t end = rdtsc_end();
+
+      stats.add((float)(end - begining));
+    }
+    bias = (uint64_t)stats.mean;
+    bias_ci = 1.96f * std::sqrt(stats.var() / stats.count);
+  }
+
+  const size_t WINDOWS = 16;
+  const double WINDOW_NS = 5e6;
+  clock_sample samples[WINDOWS + 1];
+  samples[0] = sample_clock();
+  for (size_t w = 1; w <= WINDOWS; w++) {
+    clock_sample s = sample_clock();
+    while (s.ns - samples[w - 1].ns < WINDOW_NS) {
+      s = sample_clock();
+    }
+    samples[w] = s;
+  }
+
+  // Relative to the first sample, doubles would lose the low digits of the
+  // absolute values
+  double mean_x = 0, mean_y = 0;
+  clock_sample origin = samples[0];
+  for (auto &s : samples) {
+    s.ns -= origin.ns;
+    s.cycles -= origin.cycles;
+    mean_x += s.cycles / (WINDOWS + 1);
+    mean_y += s.ns / (WINDOWS + 1);
+  }
+  double sxy = 0, sxx = 0;
+  for (auto &s : samples) {
+    sxy += (s.cycles - mean_x) * (s.ns - mean_y);
+    sxx += (s.cycles - mean_x) * (s.cycles - mean_x);
+  }
+  double slope = sxy / sxx;
+
+  // Spread of the rate of each window around the fit
+  double spread = 0;
+  for (size_t w = 1; w <= WINDOWS; w++) {
+    double rate = (samples[w].ns - samples[w - 1].ns) /
+                  (samples[w].cycles - samples[w - 1].cycles);
+    double error = std::fabs(rate / slope - 1);
+    spread = error > spread ? error : spread;
+  }
+  nano_per_cycle = (float)slope;
+
+  printf("Biais: %lu +- %.2f, nano per cycle %.4f | cycle per nano %.3f "
+         "(windows within %.3f%%)\n",
+         bias, bias_ci, nano_per_cycle, 1.0f / nano_per_cycle, spread * 100);
+}
+
+enum perf_counter {
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_COUNTER_COUNT,
+};
+
+static const char *perf_counter_names[PERF_COUNTER_COUNT] = {
+    "instructions", "branch-misses", "L1D-misses", "LLC-misses", "dTLB-misses",
+};
+
+/// Hardware counters of the current thread, read through perf_event_open
+/// They are opened as one group so that they are enabled and disabled
+/// together around each call. A counter the machine (or the container)
+/// doesn't have is left out, and without any, bench() only reports cycles
+struct perf_counters {
+  int leader = -1;
+  int fds[PERF_COUNTER_COUNT] = {-1, -1, -1, -1, -1};
+  /// Position of each counter in the group read, -1 when not opened
+  int slot[PERF_COUNTER_COUNT] = {-1, -1, -1, -1, -1};
+  int opened = 0;
+  /// Counts of the enable / timing sequence itself, per call
+  float baseline[PERF_COUNTER_COUNT] = {};
+
+  static int open_event(uint32_t type, uint64_t config, int group) {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+  }
+
+  static constexpr uint64_t cache_miss(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  }
+
+  bool available() const { return opened != 0; }
+
+  bool open() {
+    const struct {
+      uint32_t type;
+      uint64_t config;
+    } events[PERF_COUNTER_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)},
+        {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_LL)},
+        {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB)},
+    };
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+      int fd = open_event(events[c].type, events[c].config, leader);
+      if (fd == -1) {
+        printf("perf counter %s unavailable: %s\n", perf_counter_names[c],
+               strerror(errno));
+        continue;
+      }
+      leader = leader == -1 ? fd : leader;
+      fds[c] = fd;
+      slot[c] = opened++;
+    }
+    if (!available()) {
+      return false;
+    }
+
+    const size_t RETRY = 10'000;
+    reset();
     for (size_t i = 0; i < RETRY; i++) {
-      uint64_t begining = rdtsc();
-      fences();
-      fences();
-      uint64_t end = rdtsc();
+      start();
+      uint64_t begining = rdtsc_begin();
+      uint64_t end = rdtsc_end();
+      DoNotOptimize(end - begining);
+      stop();
+    }
+    read(baseline, RETRY);
+    // The group didn't run during the calibration, nothing to subtract
+    for (float &b : baseline) {
+      b = std::isnan(b) ? 0 : b;
+    }
+    return true;
+  }
 
-      sum += end - begining;
+  void close() {
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+      if (fds[c] != -1) {
+        ::close(fds[c]);
+      }
+      fds[c] = -1;
+      slot[c] = -1;
     }
-    float cycle_per_call = (float)sum / (float)RETRY;
-    bias = (uint64_t)cycle_per_call;
+    leader = -1;
+    opened = 0;
   }
 
-  // Is order optimal ?!
-  clock_gettime(CLOCK_MONOTONIC, &tend);
-  uint64_t rend = rdtsc();
+  void reset() { ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP); }
+  void start() { ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP); }
+  void stop() { ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP); }
+
+  /// Counts per call since the last reset, minus the baseline, NaN for the
+  /// counters not opened, and for all of them when the group never got to
+  /// run (values[2], the time running, is 0)
+  /// Scaled up if the kernel had to multiplex the group
+  void read(float (&per_call)[PERF_COUNTER_COUNT], size_t calls) const {
+    uint64_t values[3 + PERF_COUNTER_COUNT] = {};
+    bool ok = ::read(leader, values, sizeof(values)) > 0 && values[2] != 0;
+    float scale = ok ? (float)values[1] / (float)values[2] : 0;
+
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+      per_call[c] = ok && slot[c] != -1
+                        ? (float)values[3 + slot[c]] * scale / (float)calls -
+                              baseline[c]
+                        : NAN;
+    }
+  }
+};
 
-  assert(tstart.tv_sec == tend.tv_sec && "not supported, yet");
-  nano_per_cycle =
-      (float)(tend.tv_nsec - tstart.tv_nsec) / (float)(rend - rstart);
+static perf_counters counters;
 
-  printf("Biais: %lu, nano per cycle %.1f | cycle per nano %.1f\n", bias,
-         nano_per_cycle, 1.0f / nano_per_cycle);
+/// Opens the hardware counters that bench() reports next to cycles
+inline bool enable_perf_counters() {
+  if (!counters.available()) {
+    counters.open();
+  }
+  return counters.available();
 }
 
+/// Log-linear histogram of the samples, in cycles, as in HdrHistogram
+/// Below 2 * SUB the buckets are one cycle wide, above each power of two is
+/// split in SUB buckets, so a value is known within 1 / SUB of its magnitude
+/// and memory stays bounded whatever the tail looks like
+struct latency_histogram {
+  static constexpr size_t SUB_BITS = 5;
+  static constexpr size_t SUB = size_t{1} << SUB_BITS;
+
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t max = 0;
+
+  static size_t bucket_of(uint64_t v) {
+    if (v < 2 * SUB) {
+      return v;
+    }
+    size_t shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    return shift * SUB + (v >> shift);
+  }
+
+  static uint64_t lowest_of(size_t bucket) {
+    if (bucket < 2 * SUB) {
+      return bucket;
+    }
+    size_t shift = bucket / SUB - 1;
+    return (uint64_t)(bucket - shift * SUB) << shift;
+  }
+
+  static uint64_t width_of(size_t bucket) {
+    return bucket < 2 * SUB ? 1 : uint64_t{1} << (bucket / SUB - 1);
+  }
+
+  void add(float x) {
+    uint64_t v = x > 0 ? (uint64_t)(x + 0.5f) : 0;
+    size_t b = bucket_of(v);
+    if (b >= counts.size()) {
+      counts.resize(b + 1, 0);
+    }
+    counts[b]++;
+    total++;
+    max = v > max ? v : max;
+  }
+
+  /// Middle of the bucket holding the q-th quantile, q in [0, 1]
+  float percentile(float q) const {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)std::ceil(q * (float)total);
+    rank = rank == 0 ? 1 : rank;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < counts.size(); b++) {
+      seen += counts[b];
+      if (seen >= rank) {
+        float mid = (float)lowest_of(b) + (float)(width_of(b) - 1) / 2;
+        return mid < (float)max ? mid : (float)max;
+      }
+    }
+    return (float)max;
+  }
+
+  static void csv_header(FILE *f) { fprintf(f, "name;cycles;ns;count\n"); }
+
+  /// One line per non empty bucket, at its lowest value
+  void write_csv(FILE *f, const char *name) const {
+    for (size_t b = 0; b < counts.size(); b++) {
+      if (counts[b] != 0) {
+        uint64_t lo = lowest_of(b);
+        fprintf(f, "%s;%lu;%f;%lu\n", name, lo, (float)lo * nano_per_cycle,
+                counts[b]);
+      }
+    }
+  }
+
+  void write_json(FILE *f, const char *name) const {
+    fprintf(f,
+            "{\"name\": \"%s\", \"nano_per_cycle\": %f, \"count\": %lu, "
+            "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99.9\": %.1f, "
+            "\"max\": %lu, \"buckets\": [",
+            name, nano_per_cycle, total, percentile(0.5f), percentile(0.9f),
+            percentile(0.99f), percentile(0.999f), max);
+    bool first = true;
+    for (size_t b = 0; b < counts.size(); b++) {
+      if (counts[b] != 0) {
+        fprintf(f, "%s[%lu, %lu]", first ? "" : ", ", lowest_of(b), counts[b]);
+        first = false;
+      }
+    }
+    fprintf(f, "]}\n");
+  }
+};
+
 struct bench_res {
   float cycles;
   float cycles_var;
   float ns;
+  /// Percentiles in cycles, the outliers skipped by the mean are kept here
+  float p50;
+  float p90;
+  float p99;
+  float p999;
+  float max;
+  /// Fraction of the samples the mean skipped as outliers
+  float skipped;
+  latency_histogram hist;
+  /// Per call, NaN when the counter is unavailable
+  float counters[PERF_COUNTER_COUNT];
 };
 
-template <class F, class... Args>
-bench_res bench(const char *name, const size_t retry, F f, Args... args) {
-  printf("Bench %s\n", name);
-
-  float mean = 0;
-  float m2 = 0;
-  float count = 0;
-  size_t outlier = 0;
+inline void print_percentiles(const latency_histogram &hist) {
+  printf("p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, max %lu cycles\n",
+         hist.percentile(0.5f), hist.percentile(0.9f), hist.percentile(0.99f),
+         hist.percentile(0.999f), hist.max);
+}
 
+/// measure() with pre() called, untimed, before every call to f, to put the
+/// caches in the state to measure, see the cache state hooks below
+template <class Pre, class F, class... Args>
+bench_res measure_prepared(const size_t retry, Pre &&pre, F f, Args... args) {
+  sample_stats stats;
+  latency_histogram hist;
+  const bool counting = counters.available();
+  if (counting) {
+    counters.reset();
+  }
   for (size_t i = 0; i < retry; i++) {
-    uint64_t begining = rdtsc();
-    fences();
+    pre();
+    if (counting) {
+      counters.start();
+    }
+    uint64_t begining = rdtsc_begin();
     f(args...);
-    fences();
-    uint64_t end = rdtsc();
+    uint64_t end = rdtsc_end();
+    if (counting) {
+      counters.stop();
+    }
 
     uint64_t dr = end - begining;
     float x = (float)dr - (float)bias;
+    stats.add(x);
+    hist.add(x);
+  }
 
-    if (count >= 2 && fabs((x - mean) / sqrt(m2 / (count - 1))) > 3.0) {
-      // outlier!, skip it
-      outlier += 1;
-      continue;
-    }
-
-    count += 1;
-    float mean_next = mean + (x - mean) / count;
-    float m2_next = m2 + (x - mean) * (x - mean_next);
-
-    m2 = m2_next;
-    mean = mean_next;
+  float var = stats.var();
+  bench_res res{
+      stats.mean,
+      var,
+      stats.mean * nano_per_cycle,
+      hist.percentile(0.5f),
+      hist.percentile(0.9f),
+      hist.percentile(0.99f),
+      hist.percentile(0.999f),
+      (float)hist.max,
+      (float)stats.outlier / (float)retry,
+      std::move(hist),
+      {NAN, NAN, NAN, NAN, NAN},
+  };
+  if (counting) {
+    counters.read(res.counters, retry);
   }
+  return res;
+}
 
-  float var = m2 / (count - 1);
-  float nanos = mean * nano_per_cycle;
+/// bench() without the report
+template <class F, class... Args>
+bench_res measure(const size_t retry, F f, Args... args) {
+  return measure_prepared(retry, []() {}, f, args...);
+}
 
+inline void print_res(const bench_res &res) {
   printf("Took %.2f cycles or %.1f ns, var = %f (%f%% of samples were "
          "skipped))\n",
-         mean, nanos, std::sqrt(var), (float)outlier / (float)retry);
-  return {
-      mean,
-      var,
-      nanos,
-  };
+         res.cycles, res.ns, std::sqrt(res.cycles_var), res.skipped);
+  print_percentiles(res.hist);
+  if (counters.available()) {
+    for (int c = 0; c < PERF_COUNTER_COUNT; c++) {
+      if (!std::isnan(res.counters[c])) {
+        printf("%s%s %.2f", c == 0 ? "" : ", ", perf_counter_names[c],
+               res.counters[c]);
+      }
+    }
+    printf(" per call\n");
+  }
 }
 
-static void setup_monothreaded() {
+template <class F, class... Args>
+bench_res bench(const char *name, const size_t retry, F f, Args... args) {
+  printf("Bench %s\n", name);
+  bench_res res = measure(retry, f, args...);
+  print_res(res);
+  return res;
+}
+
+/// bench() with pre() called before every call, untimed
+template <class Pre, class F, class... Args>
+bench_res bench_prepared(const char *name, const size_t retry, Pre &&pre,
+                         F f, Args... args) {
+  printf("Bench %s\n", name);
+  bench_res res = measure_prepared(retry, pre, f, args...);
+  print_res(res);
+  return res;
+}
+
+/// Cache state hooks, to pass as pre to bench_prepared()
+/// Without one, every call reruns on the data the previous call left in
+/// cache, which is the warm case
+
+static constexpr size_t CACHE_LINE = 64;
+
+/// Evicts [data, data + bytes) from every cache level with clflush
+/// Costs about a cache miss per line, so keep the retries low on big ranges
+struct flush_range {
+  const void *data;
+  size_t bytes;
+
+  void operator()() const {
+    const char *begin = (const char *)((uintptr_t)data & ~(CACHE_LINE - 1));
+    const char *end = (const char *)data + bytes;
+    for (const char *p = begin; p < end; p += CACHE_LINE) {
+      __asm__ volatile("clflush %0" : : "m"(*p));
+    }
+    __asm__ volatile("mfence" : : : "memory");
+  }
+};
+
+/// Reads a buffer twice the size of the last level cache, which evicts
+/// everything else, including what flush_range can't name (the stack,
+/// the allocator metadata, the page tables)
+struct evict_caches {
+  std::vector<char> buffer;
+
+  evict_caches() {
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    buffer.resize(2 * (llc > 0 ? (size_t)llc : size_t{32} << 20), 1);
+  }
+
+  void operator()() {
+    size_t sum = 0;
+    for (size_t i = 0; i < buffer.size(); i += CACHE_LINE) {
+      sum += buffer[i];
+    }
+    DoNotOptimize(sum);
+  }
+};
+
+/// Reads [data, data + bytes) so that a fixed working set is cached before
+/// every call, whatever the call itself touched
+struct touch_range {
+  const void *data;
+  size_t bytes;
+
+  void operator()() const {
+    size_t sum = 0;
+    for (size_t i = 0; i < bytes; i += CACHE_LINE) {
+      sum += ((const volatile char *)data)[i];
+    }
+    DoNotOptimize(sum);
+  }
+};
+
+/// Draws the next argument at random from a pool, so that the branches and
+/// the lines touched vary from call to call; f reads current
+template <class T> struct random_key {
+  std::vector<T> pool;
+  T current{};
+  std::mt19937_64 rng{42};
+
+  explicit random_key(std::vector<T> pool) : pool(std::move(pool)) {
+    assert(!this->pool.empty());
+  }
+
+  void operator()() { current = pool[rng() % pool.size()]; }
+};
+
+inline void pin_to_cpu(size_t cpu) {
   cpu_set_t cpuset{};
   CPU_ZERO(&cpuset);
-  CPU_SET(0, &cpuset);
+  CPU_SET(cpu, &cpuset);
 
   pthread_t current_thread = pthread_self();
   pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
 }
+
+struct bench_mt_thread_res {
+  size_t ops;
+  float ops_per_sec;
+  float cycles;
+  float cycles_var;
+  float ns;
+  latency_histogram hist;
+};
+
+struct bench_mt_res {
+  float ops_per_sec;
+  /// Jain's index over the op counts of the threads: 1 when they all did as
+  /// many, 1 / thread_count when a single one did everything
+  float fairness;
+  std::vector<bench_mt_thread_res> threads;
+};
+
+/// Calls f(thread_index, args...) in a loop on thread_count threads, pinned
+/// to a cpu each (wrapping around), for duration_ms
+/// The threads spin on a start barrier so that they are released together,
+/// and every call is timed with rdtsc as in bench()
+/// The run lasts a fixed time rather than a fixed count of calls, so that a
+/// starved thread shows in the op counts
+template <class F, class... Args>
+bench_mt_res bench_mt(const char *name, const size_t thread_count,
+                      const size_t duration_ms, F f, Args... args) {
+  printf("Bench %s on %zu threads\n", name, thread_count);
+  assert(thread_count > 0);
+
+  // One line per thread, they are written concurrently
+  struct alignas(64) thread_state {
+    sample_stats stats;
+    latency_histogram hist;
+    size_t ops = 0;
+    float seconds = 0;
+  };
+  std::vector<thread_state> states(thread_count);
+  std::atomic<size_t> ready = 0;
+  std::atomic<bool> go = false;
+  std::atomic<bool> stop = false;
+  size_t cpu_count = std::thread::hardware_concurrency();
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_count; t++) {
+    threads.emplace_back([&, t]() {
+      pin_to_cpu(t % (cpu_count > 0 ? cpu_count : 1));
+      thread_state &state = states[t];
+
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+      }
+
+      struct timespec tstart = {0, 0}, tend = {0, 0};
+      clock_gettime(CLOCK_MONOTONIC, &tstart);
+      while (!stop.load(std::memory_order_relaxed)) {
+        uint64_t begining = rdtsc_begin();
+        f(t, args...);
+        uint64_t end = rdtsc_end();
+
+        float x = (float)(end - begining) - (float)bias;
+        state.stats.add(x);
+        state.hist.add(x);
+        state.ops++;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &tend);
+      state.seconds = (float)(tend.tv_sec - tstart.tv_sec) +
+                      (float)(tend.tv_nsec - tstart.tv_nsec) * 1e-9f;
+    });
+  }
+
+  while (ready.load() != thread_count) {
+  }
+  go.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+  stop.store(true, std::memory_order_relaxed);
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  bench_mt_res res{0, 0, {}};
+  float sum = 0;
+  float sum_squares = 0;
+  float seconds = 0;
+  for (size_t t = 0; t < thread_count; t++) {
+    thread_state &state = states[t];
+    bench_mt_thread_res r{
+        state.ops,
+        (float)state.ops / state.seconds,
+        state.stats.mean,
+        state.stats.var(),
+        state.stats.mean * nano_per_cycle,
+        std::move(state.hist),
+    };
+    printf("  thread %zu: %zu ops, %.0f ops/s, %.2f cycles or %.1f ns per op, "
+           "var = %f\n    ",
+           t, r.ops, r.ops_per_sec, r.cycles, r.ns, std::sqrt(r.cycles_var));
+    print_percentiles(r.hist);
+    res.threads.push_back(std::move(r));
+
+    sum += (float)state.ops;
+    sum_squares += (float)state.ops * (float)state.ops;
+    seconds = state.seconds > seconds ? state.seconds : seconds;
+  }
+  res.ops_per_sec = sum / seconds;
+  res.fairness = sum_squares > 0 ? sum * sum / (thread_count * sum_squares) : 1;
+
+  printf("Total %.0f ops/s, fairness %.3f\n", res.ops_per_sec, res.fairness);
+  return res;
+}
+
+static void setup_monothreaded() { pin_to_cpu(0); }
+
+/// Two sided p-value of the Mann-Whitney U test that a and b are drawn from
+/// the same distribution, with the normal approximation corrected for ties
+/// Good enough from ~8 values a side, which is what a sweep repeats
+inline double mann_whitney(const std::vector<float> &a,
+                           const std::vector<float> &b) {
+  size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+  if (n1 == 0 || n2 == 0) {
+    return 1;
+  }
+
+  std::vector<std::pair<float, bool>> all;
+  for (float x : a) {
+    all.push_back({x, true});
+  }
+  for (float x : b) {
+    all.push_back({x, false});
+  }
+  std::sort(all.begin(), all.end());
+
+  double rank_sum = 0;
+  double ties = 0;
+  for (size_t i = 0; i < n;) {
+    size_t j = i;
+    while (j < n && all[j].first == all[i].first) {
+      j++;
+    }
+    // The tied values i..j all get the middle rank, ranks start at 1
+    double rank = (double)(i + 1 + j) / 2;
+    for (size_t k = i; k < j; k++) {
+      rank_sum += all[k].second ? rank : 0;
+    }
+    double t = (double)(j - i);
+    ties += t * t * t - t;
+    i = j;
+  }
+
+  double u = rank_sum - (double)(n1 * (n1 + 1)) / 2;
+  double mu = (double)(n1 * n2) / 2;
+  double sigma = std::sqrt((double)(n1 * n2) / 12 *
+                           ((double)(n + 1) - ties / (double)(n * (n - 1))));
+  if (sigma == 0) {
+    return 1;
+  }
+  double z = (std::fabs(u - mu) - 0.5) / sigma;
+  return std::erfc((z > 0 ? z : 0) / std::sqrt(2.0));
+}
+
+/// One point of a sweep: a value per axis
+struct sweep_point {
+  const std::vector<std::string> *axes;
+  std::vector<size_t> values;
+
+  size_t operator[](const char *axis) const {
+    for (size_t a = 0; a < axes->size(); a++) {
+      if ((*axes)[a] == axis) {
+        return values[a];
+      }
+    }
+    assert(false && "unknown axis");
+    return 0;
+  }
+};
+
+/// Runs every variant on the cross product of the axes and writes one tidy
+/// csv: sweep;variant;<axes>;repeat;cycles;ns;p50;p99
+/// Each (point, repeat) is a block, setup() runs once per block, then every
+/// variant is warmed up and measured. The blocks, and the variants in a
+/// block, run in a random order, so that drift (frequency, page cache,
+/// other tenants) doesn't always favor the same variant
+/// compare() tells which variants got significantly slower against a csv
+/// saved by a previous run
+struct sweep {
+  const char *name;
+  std::vector<std::string> axes;
+  std::vector<std::vector<size_t>> axis_values;
+  std::vector<std::string> variants;
+  std::vector<std::function<bench_res(const sweep_point &, size_t)>> runs;
+  std::function<void(const sweep_point &)> setup_hook;
+
+  size_t retry = 10'000;
+  size_t warmup = 1'000;
+  size_t repeats = 10;
+  uint64_t seed = 42;
+
+  explicit sweep(const char *name) : name(name) {}
+
+  sweep &axis(const char *axis, std::vector<size_t> values) {
+    axes.push_back(axis);
+    axis_values.push_back(std::move(values));
+    return *this;
+  }
+
+  /// f(point) is the timed call
+  template <class F> sweep &variant(const char *variant, F f) {
+    variants.push_back(variant);
+    runs.push_back([f](const sweep_point &point, size_t retry) {
+      return measure(retry, [&]() { f(point); });
+    });
+    return *this;
+  }
+
+  /// Builds what the variants need for a point, untimed
+  sweep &setup(std::function<void(const sweep_point &)> f) {
+    setup_hook = std::move(f);
+    return *this;
+  }
+
+  std::vector<sweep_point> points() const {
+    std::vector<sweep_point> res{{&axes, {}}};
+    for (auto &values : axis_values) {
+      std::vector<sweep_point> next;
+      for (auto &p : res) {
+        for (size_t v : values) {
+          next.push_back(p);
+          next.back().values.push_back(v);
+        }
+      }
+      res = std::move(next);
+    }
+    return res;
+  }
+
+  void csv_header(FILE *f) const {
+    fprintf(f, "sweep;variant;");
+    for (auto &a : axes) {
+      fprintf(f, "%s;", a.c_str());
+    }
+    fprintf(f, "repeat;cycles;ns;p50;p99\n");
+  }
+
+  void run(const char *path) {
+    printf("Sweep %s\n", name);
+    FILE *f = fopen(path, "w");
+    assert(f);
+    csv_header(f);
+
+    std::vector<sweep_point> all = points();
+    std::vector<std::pair<size_t, size_t>> blocks;
+    for (size_t p = 0; p < all.size(); p++) {
+      for (size_t r = 0; r < repeats; r++) {
+        blocks.push_back({p, r});
+      }
+    }
+    std::mt19937_64 rng(seed);
+    std::shuffle(blocks.begin(), blocks.end(), rng);
+
+    std::vector<size_t> order(variants.size());
+    for (size_t v = 0; v < order.size(); v++) {
+      order[v] = v;
+    }
+    for (size_t b = 0; b < blocks.size(); b++) {
+      const sweep_point &point = all[blocks[b].first];
+      if (setup_hook) {
+        setup_hook(point);
+      }
+      std::shuffle(order.begin(), order.end(), rng);
+      for (size_t v : order) {
+        runs[v](point, warmup);
+        bench_res res = runs[v](point, retry);
+
+        fprintf(f, "%s;%s;", name, variants[v].c_str());
+        for (size_t value : point.values) {
+          fprintf(f, "%zu;", value);
+        }
+        fprintf(f, "%zu;%f;%f;%f;%f\n", blocks[b].second, res.cycles,
+                res.ns, res.p50, res.p99);
+      }
+      if ((b + 1) % (blocks.size() / 10 + 1) == 0) {
+        printf("  %zu / %zu\n", b + 1, blocks.size());
+      }
+    }
+    fclose(f);
+  }
+
+  /// Cycles of every repeat, by "variant;<axes>"
+  static std::map<std::string, std::vector<float>> load(const char *path) {
+    std::map<std::string, std::vector<float>> res;
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+      return res;
+    }
+    char line[1024];
+    std::vector<std::string> header;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+      std::vector<std::string> fields{""};
+      for (char *c = line; *c != '\0' && *c != '\n'; c++) {
+        if (*c == ';') {
+          fields.push_back("");
+        } else {
+          fields.back() += *c;
+        }
+      }
+      if (header.empty()) {
+        header = fields;
+        continue;
+      }
+      if (fields.size() != header.size()) {
+        continue;
+      }
+      // sweep;variant;<axes>;repeat;cycles;ns;p50;p99
+      std::string key = fields[1];
+      for (size_t i = 2; i + 5 < fields.size(); i++) {
+        key += ";" + fields[i];
+      }
+      res[key].push_back(strtof(fields[fields.size() - 4].c_str(), nullptr));
+    }
+    fclose(f);
+    return res;
+  }
+
+  /// Compares the cycles of the run in path against baseline, and reports
+  /// the (variant, point) whose median got worse with a p-value under alpha
+  /// Returns how many regressed
+  static size_t compare(const char *path, const char *baseline,
+                        double alpha = 0.01) {
+    auto current = load(path);
+    auto base = load(baseline);
+    if (base.empty()) {
+      printf("No baseline in %s\n", baseline);
+      return 0;
+    }
+
+    auto median = [](std::vector<float> v) {
+      std::sort(v.begin(), v.end());
+      return v.size() % 2 == 1
+                 ? v[v.size() / 2]
+                 : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+    };
+
+    size_t regressions = 0;
+    for (auto &[key, cycles] : current) {
+      auto it = base.find(key);
+      if (it == base.end()) {
+        continue;
+      }
+      float before = median(it->second);
+      float after = median(cycles);
+      double p = mann_whitney(cycles, it->second);
+      bool regressed = p < alpha && after > before;
+      regressions += regressed;
+      printf("%s %s: %.2f -> %.2f cycles (%+.1f%%, p = %.4f)\n",
+             regressed ? "REGRESSION" : "          ", key.c_str(), before,
+             after, (after / before - 1) * 100, p);
+    }
+    return regressions;
+  }
+};
@@ -1,12 +1,19 @@
 #include <cassert>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <ctime>
 #include <immintrin.h>
 #include <smmintrin.h>
+#include <span>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "transform.h"
 
 uint64_t rdtsc() {
   uint64_t hi, lo;
@@ -100,15 +107,73 @@ lowercase_simd_avx512(char *data, size_t length) {
 
   lowercase_table(data);
 }
+
+// Without avx512 there is no masked add, so the uppercase bytes are selected
+// with two signed compares ('A' - 1 < c < 'Z' + 1, the bytes >= 0x80 are
+// negative and never match) and the 0x20 is blended in with an and
+
+[[gnu::target("avx2")]] inline __m256i lower_simd_avx2(__m256i in) {
+  __m256i ge_a = _mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1));
+  __m256i le_z = _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in);
+  __m256i upper = _mm256_and_si256(ge_a, le_z);
+
+  return _mm256_add_epi8(in,
+                         _mm256_and_si256(upper, _mm256_set1_epi8('a' - 'A')));
+}
+
+[[gnu::target("avx2")]] void lowercase_simd_avx2(char *data, size_t length) {
+  while (length > 256 / 8) {
+    __m256i d = _mm256_loadu_si256((__m256i *)data);
+
+    _mm256_storeu_si256((__m256i *)data, lower_simd_avx2(d));
+    length -= 32;
+    data += 32;
+  }
+
+  lowercase_table(data);
+}
+
+inline __m128i lower_simd_sse2(__m128i in) {
+  __m128i ge_a = _mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1));
+  __m128i le_z = _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1));
+  __m128i upper = _mm_and_si128(ge_a, le_z);
+
+  return _mm_add_epi8(in, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+}
+
+void lowercase_simd_sse2(char *data, size_t length) {
+  while (length > 128 / 8) {
+    __m128i d = _mm_loadu_si128((__m128i *)data);
+
+    _mm_storeu_si128((__m128i *)data, lower_simd_sse2(d));
+    length -= 16;
+    data += 16;
+  }
+
+  lowercase_table(data);
+}
+
 void lowercase_simd_dispatcher(char *data, size_t length);
 void (*_lowercase_simd)(char *data, size_t length) = lowercase_simd_dispatcher;
 
+bool has_avx512() {
+  return __builtin_cpu_supports("avx512bw") &&
+         __builtin_cpu_supports("avx512vl");
+}
+
+/// Picks the widest kernel the cpu runs on the first call, the next ones go
+/// straight to it
 void lowercase_simd_dispatcher(char *data, size_t length) {
   _lowercase_simd = [](char *data, size_t) { return lowercase_table(data); };
-  if (__builtin_cpu_supports("avx512bw") &&
-      __builtin_cpu_supports("avx512vl")) {
+  if (has_avx512()) {
     printf("lowercase simd using avx512\n");
     _lowercase_simd = lowercase_simd_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    printf("lowercase simd using avx2\n");
+    _lowercase_simd = lowercase_simd_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    printf("lowercase simd using sse2\n");
+    _lowercase_simd = lowercase_simd_sse2;
   }
   return _lowercase_simd(data, length);
 }
@@ -117,9 +182,756 @@ inline void lowercase_simd(char *data, size_t length) {
   return _lowercase_simd(data, length);
 }
 
+// The kernels below work from the length alone: they neither read nor
+// write past data + length and don't need a NUL
+
+inline void lowercase_bytes(char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    uint8_t c = data[i];
+    data[i] = c + (uint8_t(c - 'A') < 26) * ('a' - 'A');
+  }
+}
+
+/// Only when a whole vector doesn't fit
+void lowercase_span_sse2(char *data, size_t length) {
+  const size_t W = 128 / 8;
+  if (length < W) {
+    return lowercase_bytes(data, length);
+  }
+
+  // The first and last vectors are unaligned and overlap the aligned body,
+  // lowercasing a byte twice is harmless
+  char *end = data + length;
+  __m128i last = _mm_loadu_si128((__m128i *)(end - W));
+  _mm_storeu_si128((__m128i *)data,
+                   lower_simd_sse2(_mm_loadu_si128((__m128i *)data)));
+
+  char *p = (char *)(((uintptr_t)data & ~(W - 1)) + W);
+  for (; p + W <= end; p += W) {
+    _mm_store_si128((__m128i *)p,
+                    lower_simd_sse2(_mm_load_si128((__m128i *)p)));
+  }
+  _mm_storeu_si128((__m128i *)(end - W), lower_simd_sse2(last));
+}
+
+[[gnu::target("avx2")]] void lowercase_span_avx2(char *data, size_t length) {
+  const size_t W = 256 / 8;
+  if (length < W) {
+    return lowercase_span_sse2(data, length);
+  }
+
+  char *end = data + length;
+  __m256i last = _mm256_loadu_si256((__m256i *)(end - W));
+  _mm256_storeu_si256((__m256i *)data,
+                      lower_simd_avx2(_mm256_loadu_si256((__m256i *)data)));
+
+  char *p = (char *)(((uintptr_t)data & ~(W - 1)) + W);
+  for (; p + W <= end; p += W) {
+    _mm256_store_si256((__m256i *)p,
+                       lower_simd_avx2(_mm256_load_si256((__m256i *)p)));
+  }
+  _mm256_storeu_si256((__m256i *)(end - W), lower_simd_avx2(last));
+}
+
+/// The head up to the first 32 bytes boundary and the tail are done with
+/// masked loads and stores, which don't fault on the masked out bytes, so the
+/// body only sees aligned vectors and nothing falls back to scalar code
+[[gnu::target("avx512vl"), gnu::target("avx512bw")]] void
+lowercase_span_avx512(char *data, size_t length) {
+  const size_t W = 256 / 8;
+  size_t misalign = (uintptr_t)data & (W - 1);
+  if (misalign != 0 && length != 0) {
+    char *base = data - misalign;
+    size_t head = W - misalign < length ? W - misalign : length;
+    __mmask32 m = (__mmask32)(((uint64_t{1} << head) - 1) << misalign);
+
+    __m256i d = _mm256_maskz_loadu_epi8(m, base);
+    _mm256_mask_storeu_epi8(base, m, lower_simd(d));
+    data += head;
+    length -= head;
+  }
+
+  while (length >= W) {
+    __m256i d = _mm256_load_si256((__m256i *)data);
+
+    _mm256_store_si256((__m256i *)data, lower_simd(d));
+    length -= W;
+    data += W;
+  }
+
+  if (length != 0) {
+    __mmask32 m = (__mmask32)((uint64_t{1} << length) - 1);
+
+    __m256i d = _mm256_maskz_loadu_epi8(m, data);
+    _mm256_mask_storeu_epi8(data, m, lower_simd(d));
+  }
+}
+
+void lowercase_span_dispatcher(char *data, size_t length);
+void (*_lowercase_span)(char *data, size_t length) = lowercase_span_dispatcher;
+
+void lowercase_span_dispatcher(char *data, size_t length) {
+  _lowercase_span = lowercase_bytes;
+  if (has_avx512()) {
+    _lowercase_span = lowercase_span_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    _lowercase_span = lowercase_span_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    _lowercase_span = lowercase_span_sse2;
+  }
+  return _lowercase_span(data, length);
+}
+
+inline void lowercase(std::span<char> s) {
+  return _lowercase_span(s.data(), s.size());
+}
+
+// lowercase_copy(dst, src, length) lowercases src into dst in one pass, they
+// must not overlap. The stores are aligned on dst, the loads may not be
+// With STREAM, the body is written with non-temporal stores: above the size
+// of the last level cache the destination would be evicted before being read
+// anyway, and going around the cache saves reading each line before writing
+// it
+
+inline void lowercase_copy_bytes(char *dst, const char *src, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    uint8_t c = src[i];
+    dst[i] = c + (uint8_t(c - 'A') < 26) * ('a' - 'A');
+  }
+}
+
+template <bool STREAM>
+void lowercase_copy_sse2(char *dst, const char *src, size_t length) {
+  const size_t W = 128 / 8;
+  if (length < W) {
+    return lowercase_copy_bytes(dst, src, length);
+  }
+
+  _mm_storeu_si128((__m128i *)dst,
+                   lower_simd_sse2(_mm_loadu_si128((__m128i *)src)));
+
+  size_t i = W - ((uintptr_t)dst & (W - 1));
+  for (; i + W <= length; i += W) {
+    __m128i d = lower_simd_sse2(_mm_loadu_si128((__m128i *)(src + i)));
+    if constexpr (STREAM) {
+      _mm_stream_si128((__m128i *)(dst + i), d);
+    } else {
+      _mm_store_si128((__m128i *)(dst + i), d);
+    }
+  }
+  if constexpr (STREAM) {
+    _mm_sfence();
+  }
+
+  _mm_storeu_si128(
+      (__m128i *)(dst + length - W),
+      lower_simd_sse2(_mm_loadu_si128((__m128i *)(src + length - W))));
+}
+
+template <bool STREAM>
+[[gnu::target("avx2")]] void lowercase_copy_avx2(char *dst, const char *src,
+                                                 size_t length) {
+  const size_t W = 256 / 8;
+  if (length < W) {
+    return lowercase_copy_sse2<STREAM>(dst, src, length);
+  }
+
+  _mm256_storeu_si256((__m256i *)dst,
+                      lower_simd_avx2(_mm256_loadu_si256((__m256i *)src)));
+
+  size_t i = W - ((uintptr_t)dst & (W - 1));
+  for (; i + W <= length; i += W) {
+    __m256i d = lower_simd_avx2(_mm256_loadu_si256((__m256i *)(src + i)));
+    if constexpr (STREAM) {
+      _mm256_stream_si256((__m256i *)(dst + i), d);
+    } else {
+      _mm256_store_si256((__m256i *)(dst + i), d);
+    }
+  }
+  if constexpr (STREAM) {
+    _mm_sfence();
+  }
+
+  _mm256_storeu_si256(
+      (__m256i *)(dst + length - W),
+      lower_simd_avx2(_mm256_loadu_si256((__m256i *)(src + length - W))));
+}
+
+template <bool STREAM>
+[[gnu::target("avx512vl"), gnu::target("avx512bw")]] void
+lowercase_copy_avx512(char *dst, const char *src, size_t length) {
+  const size_t W = 256 / 8;
+  size_t misalign = (uintptr_t)dst & (W - 1);
+  if (misalign != 0 && length != 0) {
+    size_t head = W - misalign < length ? W - misalign : length;
+    __mmask32 m = (__mmask32)((uint64_t{1} << head) - 1);
+
+    __m256i d = _mm256_maskz_loadu_epi8(m, src);
+    _mm256_mask_storeu_epi8(dst, m, lower_simd(d));
+    dst += head;
+    src += head;
+    length -= head;
+  }
+
+  while (length >= W) {
+    __m256i d = lower_simd(_mm256_loadu_si256((__m256i *)src));
+    if constexpr (STREAM) {
+      _mm256_stream_si256((__m256i *)dst, d);
+    } else {
+      _mm256_store_si256((__m256i *)dst, d);
+    }
+    length -= W;
+    dst += W;
+    src += W;
+  }
+  if constexpr (STREAM) {
+    _mm_sfence();
+  }
+
+  if (length != 0) {
+    __mmask32 m = (__mmask32)((uint64_t{1} << length) - 1);
+
+    __m256i d = _mm256_maskz_loadu_epi8(m, src);
+    _mm256_mask_storeu_epi8(dst, m, lower_simd(d));
+  }
+}
+
+void lowercase_copy_dispatcher(char *dst, const char *src, size_t length);
+void lowercase_copy_stream_dispatcher(char *dst, const char *src,
+                                      size_t length);
+void (*_lowercase_copy)(char *dst, const char *src,
+                        size_t length) = lowercase_copy_dispatcher;
+void (*_lowercase_copy_stream)(char *dst, const char *src, size_t length) =
+    lowercase_copy_stream_dispatcher;
+
+void select_lowercase_copy() {
+  _lowercase_copy = lowercase_copy_bytes;
+  _lowercase_copy_stream = lowercase_copy_bytes;
+  if (has_avx512()) {
+    _lowercase_copy = lowercase_copy_avx512<false>;
+    _lowercase_copy_stream = lowercase_copy_avx512<true>;
+  } else if (__builtin_cpu_supports("avx2")) {
+    _lowercase_copy = lowercase_copy_avx2<false>;
+    _lowercase_copy_stream = lowercase_copy_avx2<true>;
+  } else if (__builtin_cpu_supports("sse2")) {
+    _lowercase_copy = lowercase_copy_sse2<false>;
+    _lowercase_copy_stream = lowercase_copy_sse2<true>;
+  }
+}
+
+void lowercase_copy_dispatcher(char *dst, const char *src, size_t length) {
+  select_lowercase_copy();
+  return _lowercase_copy(dst, src, length);
+}
+
+void lowercase_copy_stream_dispatcher(char *dst, const char *src,
+                                      size_t length) {
+  select_lowercase_copy();
+  return _lowercase_copy_stream(dst, src, length);
+}
+
+size_t llc_size() {
+  static size_t size = []() {
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    return llc > 0 ? (size_t)llc : size_t{32} << 20;
+  }();
+  return size;
+}
+
+inline void lowercase_copy(char *dst, const char *src, size_t length) {
+  if (length > llc_size()) {
+    return _lowercase_copy_stream(dst, src, length);
+  }
+  return _lowercase_copy(dst, src, length);
+}
+
+// The file pipelines go by chunks that stay in L2: each byte is read once
+// from the page cache and written once, lowercased in between while hot
+
+const size_t PIPELINE_CHUNK = 256 << 10;
+
+/// Returns the number of bytes written, or -1 on an I/O error or when the
+/// buffer can't be allocated (errno is set, ENOMEM for the latter)
+ssize_t lowercase_fd(int in, int out) {
+  char *buffer = (char *)aligned_alloc(64, PIPELINE_CHUNK);
+  if (buffer == nullptr) {
+    errno = ENOMEM;
+    return -1;
+  }
+  ssize_t total = 0;
+  for (;;) {
+    ssize_t r = read(in, buffer, PIPELINE_CHUNK);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      total = r < 0 ? -1 : total;
+      break;
+    }
+
+    lowercase({buffer, (size_t)r});
+    for (ssize_t w = 0; w < r;) {
+      ssize_t n = write(out, buffer + w, r - w);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      // Nothing written would make no progress ever
+      if (n <= 0) {
+        errno = n == 0 ? EIO : errno;
+        free(buffer);
+        return -1;
+      }
+      w += n;
+    }
+    total += r;
+  }
+  free(buffer);
+  return total;
+}
+
+/// Returns the number of bytes written, check ferror on both files
+/// Nothing is read nor written when the buffer can't be allocated: 0 is
+/// returned with errno set to ENOMEM
+size_t lowercase_file(FILE *in, FILE *out) {
+  char *buffer = (char *)aligned_alloc(64, PIPELINE_CHUNK);
+  if (buffer == nullptr) {
+    errno = ENOMEM;
+    return 0;
+  }
+  size_t total = 0;
+  size_t r;
+  while ((r = fread(buffer, 1, PIPELINE_CHUNK, in)) != 0) {
+    lowercase({buffer, r});
+    size_t w = fwrite(buffer, 1, r, out);
+    total += w;
+    if (w != r) {
+      break;
+    }
+  }
+  free(buffer);
+  return total;
+}
+
+// UTF-8: besides ASCII, the uppercase letters of Latin-1 supplement
+// (U+00C0-U+00DE), Greek (U+0391-U+03A9) and Cyrillic (U+0400-U+042F) are
+// lowercased. They are all 2 bytes and stay 2 bytes, the other characters are
+// left as is. The input must be valid UTF-8
+
+uint32_t lower_codepoint(uint32_t cp) {
+  if (0xC0 <= cp && cp <= 0xDE && cp != 0xD7) { // but ×
+    return cp + 0x20;
+  }
+  if (0x391 <= cp && cp <= 0x3A9 && cp != 0x3A2) { // unassigned
+    return cp + 0x20;
+  }
+  if (0x410 <= cp && cp <= 0x42F) {
+    return cp + 0x20;
+  }
+  if (0x400 <= cp && cp <= 0x40F) {
+    return cp + 0x50;
+  }
+  return cp;
+}
+
+/// Reference, decodes every 2 bytes sequence
+void utf8_lowercase_scalar(char *data, size_t length) {
+  uint8_t *d = (uint8_t *)data;
+  size_t i = 0;
+  while (i < length) {
+    uint8_t c = d[i];
+    if (c < 0x80) {
+      d[i] = c + (uint8_t(c - 'A') < 26) * ('a' - 'A');
+      i++;
+    } else if ((c & 0xE0) == 0xC0 && i + 1 < length) {
+      uint32_t cp = lower_codepoint(((c & 0x1F) << 6) | (d[i + 1] & 0x3F));
+      d[i] = 0xC0 | (cp >> 6);
+      d[i + 1] = 0x80 | (cp & 0x3F);
+      i += 2;
+    } else {
+      i++;
+    }
+  }
+}
+
+/// Whether each byte of x is in [lo, hi], unsigned
+[[gnu::target("avx2")]] inline __m256i in_range_avx2(__m256i x, uint8_t lo,
+                                                     uint8_t hi) {
+  __m256i off = _mm256_sub_epi8(x, _mm256_set1_epi8((char)lo));
+  __m256i max = _mm256_set1_epi8((char)(hi - lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(off, max), off);
+}
+
+/// A block without any high bit goes through the ASCII kernel. Otherwise the
+/// lead byte of each continuation byte is brought in front of it with a one
+/// byte shuffle, the (lead, continuation) pairs to lowercase are matched,
+/// the continuation byte gets its offset and, when the letter moves to the
+/// next block of 64 code points (Α-Ω → α-ω, А-Я → а-я, Ѐ-Џ → ѐ-џ), the lead is
+/// incremented through the opposite shuffle
+/// A block never ends on a lead byte, it is left to the next one, so that a
+/// pair is always seen whole
+[[gnu::target("avx2")]] void utf8_lowercase_avx2(char *data, size_t length) {
+  const size_t W = 256 / 8;
+  char *end = data + length;
+  while ((size_t)(end - data) >= W) {
+    __m256i in = _mm256_loadu_si256((__m256i *)data);
+    __m256i out = lower_simd_avx2(in);
+    if (_mm256_movemask_epi8(in) == 0) {
+      _mm256_storeu_si256((__m256i *)data, out);
+      data += W;
+      continue;
+    }
+
+    // prev[i] = in[i - 1], 0 for the first byte
+    __m256i prev = _mm256_alignr_epi8(
+        in, _mm256_permute2x128_si256(in, in, 0x08), 16 - 1);
+    __m256i c3 = _mm256_cmpeq_epi8(prev, _mm256_set1_epi8((char)0xC3));
+    __m256i ce = _mm256_cmpeq_epi8(prev, _mm256_set1_epi8((char)0xCE));
+    __m256i d0 = _mm256_cmpeq_epi8(prev, _mm256_set1_epi8((char)0xD0));
+
+    __m256i latin = _mm256_andnot_si256(
+        _mm256_cmpeq_epi8(in, _mm256_set1_epi8((char)0x97)),
+        _mm256_and_si256(c3, in_range_avx2(in, 0x80, 0x9E)));
+    __m256i add20 = _mm256_or_si256(
+        latin, _mm256_or_si256(
+                   _mm256_and_si256(ce, in_range_avx2(in, 0x91, 0x9F)),
+                   _mm256_and_si256(d0, in_range_avx2(in, 0x90, 0x9F))));
+    __m256i sub20 = _mm256_or_si256(
+        _mm256_andnot_si256(
+            _mm256_cmpeq_epi8(in, _mm256_set1_epi8((char)0xA2)),
+            _mm256_and_si256(ce, in_range_avx2(in, 0xA0, 0xA9))),
+        _mm256_and_si256(d0, in_range_avx2(in, 0xA0, 0xAF)));
+    __m256i add10 = _mm256_and_si256(d0, in_range_avx2(in, 0x80, 0x8F));
+
+    __m256i delta = _mm256_or_si256(
+        _mm256_and_si256(add20, _mm256_set1_epi8(0x20)),
+        _mm256_or_si256(_mm256_and_si256(sub20, _mm256_set1_epi8(-0x20)),
+                        _mm256_and_si256(add10, _mm256_set1_epi8(0x10))));
+    out = _mm256_add_epi8(out, delta);
+
+    // next[i] = inc[i + 1], 0 for the last byte, -1 is a lead to increment
+    __m256i inc = _mm256_or_si256(sub20, add10);
+    __m256i next = _mm256_alignr_epi8(
+        _mm256_permute2x128_si256(inc, inc, 0x81), inc, 1);
+    out = _mm256_sub_epi8(out, next);
+
+    _mm256_storeu_si256((__m256i *)data, out);
+    uint32_t leads = _mm256_movemask_epi8(in_range_avx2(in, 0xC0, 0xFF));
+    data += W - (leads >> (W - 1));
+  }
+
+  utf8_lowercase_scalar(data, end - data);
+}
+
+void utf8_lowercase_dispatcher(char *data, size_t length);
+void (*_utf8_lowercase)(char *data, size_t length) = utf8_lowercase_dispatcher;
+
+void utf8_lowercase_dispatcher(char *data, size_t length) {
+  _utf8_lowercase = utf8_lowercase_scalar;
+  if (__builtin_cpu_supports("avx2")) {
+    _utf8_lowercase = utf8_lowercase_avx2;
+  }
+  return _utf8_lowercase(data, length);
+}
+
+inline void utf8_lowercase(std::span<char> s) {
+  return _utf8_lowercase(s.data(), s.size());
+}
+
+/// Text mixing ASCII with the scripts above, in both cases, and 3 and 4
+/// bytes characters that must be left alone
+char *utf8_corpus(size_t length) {
+  static const char *words[] = {
+      "The",     "QUICK",  "brown",      "Ελληνικά", "ΑΛΦΑΒΗΤΟ", "ωμέγα",
+      "Москва",  "ПРИВЕТ", "ЁЖИК",       "Ђорђе",    "ÉTÉ",      "Ça",
+      "Über",    "façade", "ÀÖØÞ×÷",     "naïve",    "€100",     "“quoted”",
+      "😀emoji", "ΣΊΣΥΦΟΣ", "Zürich",    "ÅNGSTRÖM",
+  };
+  const size_t COUNT = sizeof(words) / sizeof(words[0]);
+  char *d = (char *)malloc(length + 1);
+  size_t l = 0;
+  srand(42);
+  for (;;) {
+    const char *w = words[rand() % COUNT];
+    size_t wl = strlen(w);
+    if (l + wl + 1 > length) {
+      break;
+    }
+    memcpy(d + l, w, wl);
+    l += wl;
+    d[l++] = rand() % 8 == 0 ? '\n' : ' ';
+  }
+  memset(d + l, ' ', length - l);
+  d[length] = 0;
+  return d;
+}
+
+template <class F> void check_utf8_lowercase(F f) {
+  const size_t SIZE = 4096;
+  char *src = utf8_corpus(SIZE);
+  char *expected = (char *)malloc(SIZE);
+  char *d = (char *)malloc(SIZE);
+
+  // Starting on each of the first bytes, so on each kind of boundary
+  for (size_t offset = 0; offset < 64; offset++) {
+    size_t length = SIZE - offset - 64 + offset % 7;
+    memcpy(expected, src, SIZE);
+    utf8_lowercase_scalar(expected + offset, length);
+    memcpy(d, src, SIZE);
+    f(d + offset, length);
+    assert(memcmp(expected, d, SIZE) == 0);
+  }
+
+  free(d);
+  free(expected);
+  free(src);
+}
+
+template <class F> void check_lowercase_copy(F f) {
+  char src[256], expected[256], d[256];
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = (char)(i * 7 + 'A');
+  }
+
+  for (size_t src_offset = 0; src_offset < 32; src_offset += 3) {
+    for (size_t offset = 0; offset < 64; offset++) {
+      for (size_t length = 0; offset + length <= 192; length++) {
+        memset(expected, '#', sizeof(expected));
+        lowercase_copy_bytes(expected + offset, src + src_offset, length);
+        memset(d, '#', sizeof(d));
+        f(d + offset, src + src_offset, length);
+        assert(memcmp(expected, d, sizeof(d)) == 0);
+      }
+    }
+  }
+}
+
+/// Every length and misalignment of a small buffer, checking that the bytes
+/// around the span are left alone
+template <class F> void check_lowercase_span(F f) {
+  char src[256], expected[256], d[256];
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = (char)(i * 7 + 'A');
+  }
+
+  for (size_t offset = 0; offset < 64; offset++) {
+    for (size_t length = 0; offset + length <= 192; length++) {
+      memcpy(expected, src, sizeof(src));
+      lowercase_bytes(expected + offset, length);
+      memcpy(d, src, sizeof(src));
+      f(d + offset, length);
+      assert(memcmp(expected, d, sizeof(d)) == 0);
+    }
+  }
+}
+
 #define TRAMPOLINE
 
+/// An arbitrary permutation, keeping 0, to exercise the lookup path
+constexpr byte_table SCRAMBLE = []() {
+  byte_table t{};
+  for (size_t i = 0; i < 256; i++) {
+    t.map[i] = (uint8_t)(i * 37);
+  }
+  return t;
+}();
+
+static_assert(compile(LOWER).ranges && compile(LOWER).count == 1);
+static_assert(compile(UPPER).ranges && compile(UPPER).count == 1);
+static_assert(compile(SEPARATORS_TO_SPACE).ranges);
+static_assert(!compile(SCRAMBLE).ranges);
+
+/// Every kernel of the table against the table itself, on all the bytes
+template <byte_table T> void check_transform() {
+  const size_t SIZE = 1024;
+  char src[SIZE], expected[SIZE], d[SIZE];
+  for (size_t i = 0; i < SIZE; i++) {
+    src[i] = (char)(i * 131 + i / 256);
+    expected[i] = (char)T((uint8_t)src[i]);
+  }
+
+  auto check = [&](void (*kernel)(char *, size_t)) {
+    for (size_t length = 0; length < SIZE; length += 1 + length / 8) {
+      memcpy(d, src, SIZE);
+      kernel(d, length);
+      assert(memcmp(expected, d, length) == 0);
+      assert(memcmp(src + length, d + length, SIZE - length) == 0);
+    }
+  };
+  if constexpr (compile(T).ranges) {
+    check(transform_ssse3<T>);
+    if (__builtin_cpu_supports("avx2")) {
+      check(transform_avx2<T>);
+    }
+  } else if (__builtin_cpu_supports("avx512vbmi") &&
+             __builtin_cpu_supports("avx512bw")) {
+    check(transform_avx512vbmi<T>);
+  }
+  check([](char *d, size_t length) { transform<T>::apply({d, length}); });
+}
+
+void check_compare_ignore_case() {
+  const char *a = "Hello, World! The Quick Brown Fox Jumps Over The Lazy Dog";
+  const char *b = "hello, world! the quick brown fox jumps over the lazy dog";
+  const char *c = "hello, world! the quick brown fox jumps over the lazy cat";
+  size_t l = strlen(a);
+  assert(compare_ignore_case({a, l}, {b, l}) == 0);
+  assert(compare_ignore_case({a, l}, {c, l}) > 0);
+  assert(compare_ignore_case({c, l}, {a, l}) < 0);
+  assert(compare_ignore_case({a, l - 1}, {b, l}) < 0);
+  // 'Z' < '[' < 'z', the order is the one of the lowercased strings
+  assert(compare_ignore_case({"Z", 1}, {"[", 1}) > 0);
+}
+
+template <class F>
+void bench_lowercase(const char *name, F f, const char *ndata, size_t l,
+                     const char *base) {
+  auto d = strdup(ndata);
+  f(d, l);
+  assert(strcmp(base, d) == 0);
+  free(d);
+
+  uint64_t sum = 0;
+
+  clock_t before = clock();
+  for (size_t r = 0; r < RETRY; r++) {
+    auto d = strdup(ndata);
+
+    uint64_t start = rdtsc();
+    f(d, l);
+    uint64_t end = rdtsc();
+
+    free(d);
+
+    sum += end - start;
+  }
+  clock_t after = clock();
+  float msec = float(after - before) / (float)CLOCKS_PER_SEC;
+
+  printf("%s took: %.4f byte per cycle, %.2fmsec\n", name,
+         l * RETRY / (float)sum, msec);
+}
+
+template <class F>
+void bench_lowercase_copy(const char *name, F f, const char *src, size_t l,
+                          const char *expected, size_t retry) {
+  char *d = (char *)malloc(l);
+  f(d, src, l);
+  assert(memcmp(expected, d, l) == 0);
+
+  uint64_t sum = 0;
+
+  clock_t before = clock();
+  for (size_t r = 0; r < retry; r++) {
+    uint64_t start = rdtsc();
+    f(d, src, l);
+    uint64_t end = rdtsc();
+
+    sum += end - start;
+  }
+  clock_t after = clock();
+  float msec = float(after - before) / (float)CLOCKS_PER_SEC;
+  free(d);
+
+  printf("%s took: %.4f byte per cycle, %.2fmsec, %.2f GB/s\n", name,
+         l * retry / (float)sum, msec, l * retry / msec / 1e9);
+}
+
+void copy_then_lowercase(char *dst, const char *src, size_t length) {
+  memcpy(dst, src, length);
+  lowercase({dst, length});
+}
+
+/// Through a temporary file, so from the page cache, to /dev/null
+void bench_pipeline(const char *corpus, size_t l) {
+  FILE *in = tmpfile();
+  int out = open("/dev/null", O_WRONLY);
+  assert(in != nullptr && out != -1);
+  size_t written = fwrite(corpus, 1, l, in);
+  assert(written == l);
+  fflush(in);
+
+  rewind(in);
+  struct timespec tstart = {0, 0}, tend = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tstart);
+  ssize_t bytes = lowercase_fd(fileno(in), out);
+  clock_gettime(CLOCK_MONOTONIC, &tend);
+  assert(bytes == (ssize_t)l);
+  float sec = (float)(tend.tv_sec - tstart.tv_sec) +
+              (float)(tend.tv_nsec - tstart.tv_nsec) * 1e-9f;
+  printf("lowercase_fd took: %.2fs, %.2f GB/s\n", sec, l / sec / 1e9);
+
+  FILE *null = fdopen(out, "w");
+  rewind(in);
+  clock_gettime(CLOCK_MONOTONIC, &tstart);
+  size_t file_bytes = lowercase_file(in, null);
+  clock_gettime(CLOCK_MONOTONIC, &tend);
+  assert(file_bytes == l);
+  sec = (float)(tend.tv_sec - tstart.tv_sec) +
+        (float)(tend.tv_nsec - tstart.tv_nsec) * 1e-9f;
+  printf("lowercase_file took: %.2fs, %.2f GB/s\n", sec, l / sec / 1e9);
+
+  fclose(null);
+  fclose(in);
+}
+
+/// ./lowercase <in> <out> lowercases a file
+/// The output is only truncated once the input opened and is known to be
+/// another file: lowercasing a file into itself would empty it first
+int lowercase_path(const char *in_path, const char *out_path) {
+  int in = open(in_path, O_RDONLY);
+  if (in == -1) {
+    perror(in_path);
+    return 1;
+  }
+  int out = open(out_path, O_WRONLY | O_CREAT, 0644);
+  if (out == -1) {
+    perror(out_path);
+    close(in);
+    return 1;
+  }
+  auto fail = [in, out](const char *what) {
+    perror(what);
+    close(in);
+    close(out);
+    return 1;
+  };
+
+  struct stat in_stat, out_stat;
+  if (fstat(in, &in_stat) == -1 || fstat(out, &out_stat) == -1) {
+    return fail("fstat");
+  }
+  if (in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+    fprintf(stderr, "%s and %s are the same file\n", in_path, out_path);
+    close(in);
+    close(out);
+    return 1;
+  }
+  if (ftruncate(out, 0) == -1) {
+    return fail(out_path);
+  }
+
+  struct timespec tstart = {0, 0}, tend = {0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &tstart);
+  ssize_t bytes = lowercase_fd(in, out);
+  clock_gettime(CLOCK_MONOTONIC, &tend);
+  close(in);
+  close(out);
+  if (bytes < 0) {
+    perror("lowercase_fd");
+    return 1;
+  }
+
+  float sec = (float)(tend.tv_sec - tstart.tv_sec) +
+              (float)(tend.tv_nsec - tstart.tv_nsec) * 1e-9f;
+  printf("%zd bytes in %.2fs, %.2f GB/s\n", bytes, sec, bytes / sec / 1e9);
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
+  if (argc == 3) {
+    return lowercase_path(argv[1], argv[2]);
+  }
+
   size_t l = (size_t)(data_end - data);
   char *ndata = (char *)malloc(l + 1);
   memcpy(ndata, data, l);
@@ -128,6 +940,36 @@ int main(int argc, char *argv[]) {
   auto base = strdup(ndata);
   lowercase_0(base, l);
 
+  check_lowercase_span(lowercase_span_sse2);
+  if (__builtin_cpu_supports("avx2")) {
+    check_lowercase_span(lowercase_span_avx2);
+  }
+  if (has_avx512()) {
+    check_lowercase_span(lowercase_span_avx512);
+  }
+  assert(lower_codepoint(U'É') == U'é' && lower_codepoint(U'Ω') == U'ω' &&
+         lower_codepoint(U'Я') == U'я' && lower_codepoint(U'Ё') == U'ё' &&
+         lower_codepoint(U'×') == U'×' && lower_codepoint(U'é') == U'é');
+  if (__builtin_cpu_supports("avx2")) {
+    check_utf8_lowercase(utf8_lowercase_avx2);
+  }
+  check_transform<LOWER>();
+  check_transform<UPPER>();
+  check_transform<SEPARATORS_TO_SPACE>();
+  check_transform<SCRAMBLE>();
+  check_compare_ignore_case();
+  check_lowercase_copy(lowercase_copy);
+  check_lowercase_copy(lowercase_copy_sse2<false>);
+  check_lowercase_copy(lowercase_copy_sse2<true>);
+  if (__builtin_cpu_supports("avx2")) {
+    check_lowercase_copy(lowercase_copy_avx2<false>);
+    check_lowercase_copy(lowercase_copy_avx2<true>);
+  }
+  if (has_avx512()) {
+    check_lowercase_copy(lowercase_copy_avx512<false>);
+    check_lowercase_copy(lowercase_copy_avx512<true>);
+  }
+
   printf("starting !\n");
   {
     uint64_t sum = 0;
@@ -230,30 +1072,110 @@ int main(int argc, char *argv[]) {
            l * RETRY / (float)sum, msec);
   }
 
+  bench_lowercase("lowercase_simd_sse2", lowercase_simd_sse2, ndata, l, base);
+  if (__builtin_cpu_supports("avx2")) {
+    bench_lowercase("lowercase_simd_avx2", lowercase_simd_avx2, ndata, l,
+                    base);
+  }
+  if (has_avx512()) {
+    bench_lowercase("lowercase_simd_avx512", lowercase_simd_avx512, ndata, l,
+                    base);
+  }
+  bench_lowercase("lowercase_simd", lowercase_simd, ndata, l, base);
+
+  bench_lowercase("lowercase_span_sse2", lowercase_span_sse2, ndata, l, base);
+  if (__builtin_cpu_supports("avx2")) {
+    bench_lowercase("lowercase_span_avx2", lowercase_span_avx2, ndata, l,
+                    base);
+  }
+  if (has_avx512()) {
+    bench_lowercase("lowercase_span_avx512", lowercase_span_avx512, ndata, l,
+                    base);
+  }
+  bench_lowercase(
+      "lowercase(span)",
+      [](char *d, size_t l) { lowercase({d, l}); }, ndata, l, base);
+
+  // Out of place, no strdup to pay for
+  bench_lowercase_copy("copy_then_lowercase", copy_then_lowercase, ndata, l,
+                       base, RETRY);
+  bench_lowercase_copy("lowercase_copy", _lowercase_copy, ndata, l, base,
+                       RETRY);
+  bench_lowercase_copy("lowercase_copy stream", _lowercase_copy_stream, ndata,
+                       l, base, RETRY);
+
+  // The engine, lowercase should match the hand written kernels
+  bench_lowercase(
+      "transform<LOWER>",
+      [](char *d, size_t l) { transform<LOWER>::apply({d, l}); }, ndata, l,
+      base);
   {
-    auto d = strdup(ndata);
-    lowercase_simd(d, l);
-    assert(strcmp(base, d) == 0);
-    free(d);
+    auto bench_table = [&]<byte_table T>(const char *name) {
+      auto expected = strdup(ndata);
+      transform_scalar<T>(expected, l);
+      bench_lowercase(
+          name, [](char *d, size_t l) { transform<T>::apply({d, l}); }, ndata,
+          l, expected);
+      free(expected);
+    };
+    bench_table.operator()<UPPER>("transform<UPPER>");
+    bench_table.operator()<SEPARATORS_TO_SPACE>(
+        "transform<SEPARATORS_TO_SPACE>");
+    bench_table.operator()<SCRAMBLE>("transform<SCRAMBLE> (lookup)");
 
     uint64_t sum = 0;
-
-    clock_t before = clock();
+    int res = 0;
     for (size_t r = 0; r < RETRY; r++) {
-      auto d = strdup((char *)data);
-
       uint64_t start = rdtsc();
-      lowercase_simd(d, l);
+      res |= compare_ignore_case({ndata, l}, {base, l});
       uint64_t end = rdtsc();
 
-      free(d);
-
       sum += end - start;
     }
-    clock_t after = clock();
-    float msec = float(after - before) / (float)CLOCKS_PER_SEC;
+    assert(res == 0);
+    printf("compare_ignore_case took: %.4f byte per cycle\n",
+           l * RETRY / (float)sum);
+  }
+
+  // Same size as the ascii text
+  char *mixed = utf8_corpus(l);
+  char *mixed_base = strdup(mixed);
+  utf8_lowercase_scalar(mixed_base, l);
+  bench_lowercase("utf8_lowercase_scalar ascii", utf8_lowercase_scalar, ndata,
+                  l, base);
+  bench_lowercase("utf8_lowercase_scalar mixed", utf8_lowercase_scalar, mixed,
+                  l, mixed_base);
+  if (__builtin_cpu_supports("avx2")) {
+    bench_lowercase("utf8_lowercase_avx2 ascii", utf8_lowercase_avx2, ndata, l,
+                    base);
+    bench_lowercase("utf8_lowercase_avx2 mixed", utf8_lowercase_avx2, mixed, l,
+                    mixed_base);
+  }
+  free(mixed_base);
+  free(mixed);
 
-    printf("lowercase_simd took: %.4f byte per cycle, %.2fmsec\n",
-           strlen((char *)data) * RETRY / (float)sum, msec);
+  // A corpus well above the last level cache
+  const size_t LARGE = 512 << 20;
+  size_t large_l = LARGE / l * l;
+  char *large = (char *)malloc(large_l);
+  char *large_base = (char *)malloc(large_l);
+  for (size_t i = 0; i < large_l; i += l) {
+    memcpy(large + i, ndata, l);
+    memcpy(large_base + i, base, l);
   }
+  printf("large corpus: %zu MB, llc %zu MB\n", large_l >> 20,
+         llc_size() >> 20);
+  bench_lowercase_copy("copy_then_lowercase", copy_then_lowercase, large,
+                       large_l, large_base, 5);
+  bench_lowercase_copy("lowercase_copy", _lowercase_copy, large, large_l,
+                       large_base, 5);
+  bench_lowercase_copy("lowercase_copy stream", _lowercase_copy_stream, large,
+                       large_l, large_base, 5);
+  // What callers get: above the llc, the streaming one
+  bench_lowercase_copy("lowercase_copy dispatched", lowercase_copy, large,
+                       large_l, large_base, 5);
+  bench_lowercase_copy("memcpy", memcpy, large, large_l, large, 5);
+  bench_pipeline(large, large_l);
+  free(large_base);
+  free(large);
 }
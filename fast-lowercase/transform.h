@@ -0,0 +1,313 @@
+#ifndef INCLUDE_FAST_LOWERCASE_TRANSFORM_H_
+#define INCLUDE_FAST_LOWERCASE_TRANSFORM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+#include <initializer_list>
+#include <span>
+#include <utility>
+
+// A byte to byte transform, generalizing lower_simd
+// It is described as a 256 entries table, usually built from ranges, and
+// compiled at compile time into the cheapest vector sequence:
+// - a few ranges mapped to an offset or a constant (lowercase, uppercase,
+//   separators to spaces...) become one unsigned range compare each, and an
+//   add or a blend
+// - anything else is a lookup of the whole table: two vpermi2b and a blend on
+//   avx512vbmi, else the scalar loop, which beats the 16 pshufb rows it would
+//   take with avx2
+// and the kernel is picked on the first call
+
+struct byte_table {
+  uint8_t map[256];
+
+  static constexpr byte_table identity() {
+    byte_table t{};
+    for (size_t i = 0; i < 256; i++) {
+      t.map[i] = (uint8_t)i;
+    }
+    return t;
+  }
+
+  /// [lo, hi] mapped to x + offset
+  constexpr byte_table shift(uint8_t lo, uint8_t hi, int offset) const {
+    byte_table t = *this;
+    for (size_t i = lo; i <= hi; i++) {
+      t.map[i] = (uint8_t)(i + offset);
+    }
+    return t;
+  }
+
+  /// Every byte of bytes mapped to value
+  constexpr byte_table set(std::initializer_list<uint8_t> bytes,
+                           uint8_t value) const {
+    byte_table t = *this;
+    for (uint8_t b : bytes) {
+      t.map[b] = value;
+    }
+    return t;
+  }
+
+  constexpr uint8_t operator()(uint8_t c) const { return map[c]; }
+};
+
+/// A run of bytes, x -> x + value for OFFSET, x -> value for CONSTANT
+struct byte_segment {
+  enum kind_t : uint8_t { OFFSET, CONSTANT };
+
+  uint8_t lo;
+  uint8_t hi;
+  kind_t kind;
+  uint8_t value;
+};
+
+/// A segment costs about as much as a row of the lookup, which has 16
+constexpr size_t MAX_SEGMENTS = 16;
+
+struct byte_plan {
+  bool ranges; // else lookup
+  size_t count;
+  byte_segment segments[MAX_SEGMENTS];
+};
+
+/// Splits the bytes the table changes in maximal runs with the same offset
+/// or the same value, preferring offsets
+constexpr byte_plan compile(const byte_table &t) {
+  byte_plan plan{true, 0, {}};
+  size_t i = 0;
+  while (i < 256) {
+    if (t.map[i] == i) {
+      i++;
+      continue;
+    }
+
+    uint8_t offset = (uint8_t)(t.map[i] - i);
+    size_t by_offset = i;
+    while (by_offset + 1 < 256 && t.map[by_offset + 1] != by_offset + 1 &&
+           (uint8_t)(t.map[by_offset + 1] - (by_offset + 1)) == offset) {
+      by_offset++;
+    }
+    size_t by_value = i;
+    while (by_value + 1 < 256 && t.map[by_value + 1] != by_value + 1 &&
+           t.map[by_value + 1] == t.map[i]) {
+      by_value++;
+    }
+
+    if (plan.count == MAX_SEGMENTS) {
+      return {false, 0, {}};
+    }
+    plan.segments[plan.count++] =
+        by_offset >= by_value
+            ? byte_segment{(uint8_t)i, (uint8_t)by_offset,
+                           byte_segment::OFFSET, offset}
+            : byte_segment{(uint8_t)i, (uint8_t)by_value,
+                           byte_segment::CONSTANT, t.map[i]};
+    i = (by_offset >= by_value ? by_offset : by_value) + 1;
+  }
+  return plan;
+}
+
+// The kernels unroll over the segments or the rows with lambdas, which must
+// be inlined whatever the optimization level to keep everything in registers
+#define INLINE_LAMBDA __attribute__((always_inline))
+
+template <byte_table T> void transform_scalar(char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    data[i] = (char)T((uint8_t)data[i]);
+  }
+}
+
+/// The segments are matched on the input, so that they never chain
+template <byte_table T>
+  requires(compile(T).ranges)
+[[gnu::target("avx2")]] inline __m256i transform_avx2(__m256i in) {
+  constexpr byte_plan P = compile(T);
+  __m256i out = in;
+  [&]<size_t... S>(std::index_sequence<S...>) INLINE_LAMBDA {
+    (
+        [&]() INLINE_LAMBDA {
+          constexpr byte_segment seg = P.segments[S];
+          __m256i off = _mm256_sub_epi8(in, _mm256_set1_epi8((char)seg.lo));
+          __m256i m = _mm256_cmpeq_epi8(
+              _mm256_min_epu8(off, _mm256_set1_epi8((char)(seg.hi - seg.lo))),
+              off);
+          __m256i v = _mm256_set1_epi8((char)seg.value);
+          if constexpr (seg.kind == byte_segment::OFFSET) {
+            out = _mm256_add_epi8(out, _mm256_and_si256(m, v));
+          } else {
+            out = _mm256_blendv_epi8(out, v, m);
+          }
+        }(),
+        ...);
+  }(std::make_index_sequence<P.count>{});
+  return out;
+}
+
+template <byte_table T>
+  requires(compile(T).ranges)
+[[gnu::target("ssse3")]] inline __m128i transform_ssse3(__m128i in) {
+  constexpr byte_plan P = compile(T);
+  __m128i out = in;
+  [&]<size_t... S>(std::index_sequence<S...>) INLINE_LAMBDA {
+    (
+        [&]() INLINE_LAMBDA {
+          constexpr byte_segment seg = P.segments[S];
+          __m128i off = _mm_sub_epi8(in, _mm_set1_epi8((char)seg.lo));
+          __m128i m = _mm_cmpeq_epi8(
+              _mm_min_epu8(off, _mm_set1_epi8((char)(seg.hi - seg.lo))), off);
+          __m128i v = _mm_set1_epi8((char)seg.value);
+          if constexpr (seg.kind == byte_segment::OFFSET) {
+            out = _mm_add_epi8(out, _mm_and_si128(m, v));
+          } else {
+            out = _mm_or_si128(_mm_andnot_si128(m, out), _mm_and_si128(m, v));
+          }
+        }(),
+        ...);
+  }(std::make_index_sequence<P.count>{});
+  return out;
+}
+
+/// Any table: vpermi2b looks up 128 entries from the low 7 bits, once for
+/// each half of the table, and the high bit picks the half
+template <byte_table T>
+[[gnu::target("avx512vbmi,avx512bw")]] inline __m512i
+transform_avx512vbmi(__m512i in) {
+  __m512i q0 = _mm512_loadu_si512(T.map);
+  __m512i q1 = _mm512_loadu_si512(T.map + 64);
+  __m512i q2 = _mm512_loadu_si512(T.map + 128);
+  __m512i q3 = _mm512_loadu_si512(T.map + 192);
+  __m512i low = _mm512_permutex2var_epi8(q0, in, q1);
+  __m512i high = _mm512_permutex2var_epi8(q2, in, q3);
+  return _mm512_mask_blend_epi8(_mm512_movepi8_mask(in), low, high);
+}
+
+// The last vector is loaded before anything is stored and stored last: it
+// overlaps the body, but both write the transform of the original bytes, so
+// even a transform that isn't idempotent is right
+
+template <byte_table T>
+  requires(compile(T).ranges)
+[[gnu::target("avx2")]] void transform_avx2(char *data, size_t length) {
+  const size_t W = 256 / 8;
+  if (length < W) {
+    return transform_scalar<T>(data, length);
+  }
+
+  char *end = data + length;
+  __m256i last = _mm256_loadu_si256((__m256i *)(end - W));
+  for (; data + W <= end; data += W) {
+    __m256i in = _mm256_loadu_si256((__m256i *)data);
+    _mm256_storeu_si256((__m256i *)data, transform_avx2<T>(in));
+  }
+  _mm256_storeu_si256((__m256i *)(end - W), transform_avx2<T>(last));
+}
+
+template <byte_table T>
+  requires(compile(T).ranges)
+[[gnu::target("ssse3")]] void transform_ssse3(char *data, size_t length) {
+  const size_t W = 128 / 8;
+  if (length < W) {
+    return transform_scalar<T>(data, length);
+  }
+
+  char *end = data + length;
+  __m128i last = _mm_loadu_si128((__m128i *)(end - W));
+  for (; data + W <= end; data += W) {
+    __m128i in = _mm_loadu_si128((__m128i *)data);
+    _mm_storeu_si128((__m128i *)data, transform_ssse3<T>(in));
+  }
+  _mm_storeu_si128((__m128i *)(end - W), transform_ssse3<T>(last));
+}
+
+template <byte_table T>
+[[gnu::target("avx512vbmi,avx512bw")]] void
+transform_avx512vbmi(char *data, size_t length) {
+  const size_t W = 512 / 8;
+  if (length < W) {
+    return transform_scalar<T>(data, length);
+  }
+
+  char *end = data + length;
+  __m512i last = _mm512_loadu_si512(end - W);
+  for (; data + W <= end; data += W) {
+    __m512i in = _mm512_loadu_si512(data);
+    _mm512_storeu_si512(data, transform_avx512vbmi<T>(in));
+  }
+  _mm512_storeu_si512(end - W, transform_avx512vbmi<T>(last));
+}
+
+/// One trampoline per table, as _lowercase_simd
+template <byte_table T> struct transform {
+  static void dispatcher(char *data, size_t length);
+  static inline void (*kernel)(char *data, size_t length) = dispatcher;
+
+  static void apply(std::span<char> s) { return kernel(s.data(), s.size()); }
+};
+
+template <byte_table T>
+void transform<T>::dispatcher(char *data, size_t length) {
+  kernel = transform_scalar<T>;
+  if constexpr (compile(T).ranges) {
+    if (__builtin_cpu_supports("avx2")) {
+      kernel = transform_avx2<T>;
+    } else if (__builtin_cpu_supports("ssse3")) {
+      kernel = transform_ssse3<T>;
+    }
+  } else {
+    if (__builtin_cpu_supports("avx512vbmi") &&
+        __builtin_cpu_supports("avx512bw")) {
+      kernel = transform_avx512vbmi<T>;
+    }
+  }
+  return kernel(data, length);
+}
+
+constexpr byte_table LOWER = byte_table::identity().shift('A', 'Z', 'a' - 'A');
+constexpr byte_table UPPER = byte_table::identity().shift('a', 'z', 'A' - 'a');
+/// Punctuation and white space to a space, to split words
+constexpr byte_table SEPARATORS_TO_SPACE = byte_table::identity().set(
+    {'\t', '\n', '\v', '\f', '\r', ',', ';', ':', '.', '!', '?'}, ' ');
+
+inline int compare_ignore_case_scalar(const char *a, const char *b,
+                                      size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    int d = (int)LOWER((uint8_t)a[i]) - (int)LOWER((uint8_t)b[i]);
+    if (d != 0) {
+      return d;
+    }
+  }
+  return 0;
+}
+
+/// memcmp of the lowercased strings
+[[gnu::target("avx2")]] inline int
+compare_ignore_case_avx2(const char *a, const char *b, size_t length) {
+  const size_t W = 256 / 8;
+  size_t i = 0;
+  for (; i + W <= length; i += W) {
+    __m256i la = transform_avx2<LOWER>(_mm256_loadu_si256((__m256i *)(a + i)));
+    __m256i lb = transform_avx2<LOWER>(_mm256_loadu_si256((__m256i *)(b + i)));
+    uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(la, lb));
+    if (equal != UINT32_MAX) {
+      size_t j = i + __builtin_ctz(~equal);
+      return (int)LOWER((uint8_t)a[j]) - (int)LOWER((uint8_t)b[j]);
+    }
+  }
+  return compare_ignore_case_scalar(a + i, b + i, length - i);
+}
+
+inline int compare_ignore_case(std::span<const char> a,
+                               std::span<const char> b) {
+  static int (*kernel)(const char *, const char *, size_t) =
+      __builtin_cpu_supports("avx2") ? compare_ignore_case_avx2
+                                     : compare_ignore_case_scalar;
+  size_t length = a.size() < b.size() ? a.size() : b.size();
+  int d = kernel(a.data(), b.data(), length);
+  if (d != 0) {
+    return d;
+  }
+  return a.size() < b.size() ? -1 : a.size() > b.size();
+}
+
+#endif // INCLUDE_FAST_LOWERCASE_TRANSFORM_H_
@@ -0,0 +1,19 @@
+import matplotlib.pyplot as plt
+import pandas as pd
+
+# One CDF per variant, for the largest N
+df = pd.read_csv("./res_latency.csv", sep=";")
+df[["variant", "N"]] = df["name"].str.rsplit(" N=", n=1, expand=True)
+df["N"] = df["N"].astype(int)
+df = df[df["N"] == df["N"].max()]
+
+fig, ax = plt.subplots()
+for variant, d in df.groupby("variant"):
+    d = d.sort_values("ns")
+    ax.plot(d["ns"], d["count"].cumsum() / d["count"].sum(), label=variant)
+
+ax.legend()
+ax.set_xscale("log", base=2)
+ax.set_xlabel("time (ns)")
+ax.set_ylabel("fraction of calls")
+plt.show()
@@ -88,8 +88,28 @@ struct res {
   bench_res sorted_branchless1;
   bench_res sorted_branchless2;
   bench_res sorted_naive_w_prefetching;
+  bench_res sorted_naive_cold;
+  bench_res sorted_branchless1_cold;
+  bench_res sorted_branchless2_cold;
+  bench_res sorted_naive_w_prefetching_cold;
 };
 
+/// Every call searches a random prime in an array flushed from the caches,
+/// as a lookup in a big table does in production
+template <class F>
+bench_res bench_cold(const char *name, const size_t RETRY,
+                     std::vector<uint64_t> &primes, F f) {
+  random_key<uint64_t> key(primes);
+  flush_range flush{primes.data(), primes.size() * sizeof(uint64_t)};
+  return bench_prepared(
+      name, RETRY,
+      [&]() {
+        key();
+        flush();
+      },
+      [&]() { DoNotOptimize(f(primes, key.current)); });
+}
+
 res dobench(const size_t PRIME_COUNT, const size_t RETRY) {
   std::vector<uint64_t> primes;
   primes.reserve(PRIME_COUNT);
@@ -102,6 +122,8 @@ res dobench(const size_t PRIME_COUNT, const size_t RETRY) {
   assert(find_sorted_kindabranchless1<uint64_t>(primes, n) == expected);
   assert(find_sorted_kindabranchless2<uint64_t>(primes, n) == expected);
 
+  // Flushing costs a miss per line of the array, far more than a search
+  const size_t COLD_RETRY = RETRY / 100;
   return {
       bench("sorted naive", RETRY, find_sorted_naive<uint64_t>, primes, n),
       bench("sorted branchless 1", RETRY,
@@ -110,6 +132,14 @@ res dobench(const size_t PRIME_COUNT, const size_t RETRY) {
             find_sorted_kindabranchless2<uint64_t>, primes, n),
       bench("naive w prefetching", RETRY,
             find_sorted_naive_w_prefetching<uint64_t>, primes, n),
+      bench_cold("sorted naive cold", COLD_RETRY, primes,
+                 find_sorted_naive<uint64_t>),
+      bench_cold("sorted branchless 1 cold", COLD_RETRY, primes,
+                 find_sorted_kindabranchless1<uint64_t>),
+      bench_cold("sorted branchless 2 cold", COLD_RETRY, primes,
+                 find_sorted_kindabranchless2<uint64_t>),
+      bench_cold("naive w prefetching cold", COLD_RETRY, primes,
+                 find_sorted_naive_w_prefetching<uint64_t>),
   };
 }
 
@@ -117,19 +147,40 @@ int main(int argc, char *argv[]) {
   setup_monothreaded();
   FILE *f = fopen("res.csv", "w");
   fprintf(f, "N;sorted naive;sorted branchless1;sorted branchless2;sorted "
-             "naive w prefetching\n");
+             "naive w prefetching;sorted naive cold;sorted branchless1 "
+             "cold;sorted branchless2 cold;sorted naive w prefetching cold\n");
+  FILE *latency = fopen("res_latency.csv", "w");
+  latency_histogram::csv_header(latency);
 
   compute_bias();
+  enable_perf_counters();
   const size_t RETRY = 1'000'000;
   for (size_t n = 10; n < 20; n++) {
     printf("PRIME COUNT = 1 << %zu\n", n);
     res r = dobench(1 << n, RETRY);
 
-    fprintf(f, "%d;%f;%f;%f;%f\n", 1 << n, r.sorted_naive.ns,
+    fprintf(f, "%d;%f;%f;%f;%f;%f;%f;%f;%f\n", 1 << n, r.sorted_naive.ns,
             r.sorted_branchless1.ns, r.sorted_branchless2.ns,
-            r.sorted_naive_w_prefetching.ns);
+            r.sorted_naive_w_prefetching.ns, r.sorted_naive_cold.ns,
+            r.sorted_branchless1_cold.ns, r.sorted_branchless2_cold.ns,
+            r.sorted_naive_w_prefetching_cold.ns);
+
+    char name[64];
+    auto dump = [&](const char *variant, const bench_res &b) {
+      snprintf(name, sizeof(name), "%s N=%d", variant, 1 << n);
+      b.hist.write_csv(latency, name);
+    };
+    dump("sorted naive", r.sorted_naive);
+    dump("sorted branchless1", r.sorted_branchless1);
+    dump("sorted branchless2", r.sorted_branchless2);
+    dump("sorted naive w prefetching", r.sorted_naive_w_prefetching);
+    dump("sorted naive cold", r.sorted_naive_cold);
+    dump("sorted branchless1 cold", r.sorted_branchless1_cold);
+    dump("sorted branchless2 cold", r.sorted_branchless2_cold);
+    dump("sorted naive w prefetching cold", r.sorted_naive_w_prefetching_cold);
   }
 
+  fclose(latency);
   fclose(f);
   return 0;
 }
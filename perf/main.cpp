@@ -1,94 +1,196 @@
-#include <cassert>
-#include <cstddef>
-#include <cstdint>
-#include <cstdio>
-#include <ctime>
+#include "../bench.h"
 
-#define NO_INLINE __attribute__((noinline))
-inline void blackbox() { asm volatile(""); }
+#include <utility>
 
-uint64_t bias = 0;
-float nano_per_cycle = 0;
+/// Cost of the ways to call a function, from a plain loop iteration to a
+/// virtual call
+/// A single call is a few cycles, below the noise of the timing sequence
+/// itself, so every variant is timed over unrolled batches of calls and
+/// reported per call from the difference between two batch sizes
 
-/// Serialize all memory read / writes
-void fences() { __asm__ volatile("mfence\n\tlfence"); }
+NO_INLINE void f() { blackbox(); }
+inline void g() { blackbox(); }
 
-uint64_t rdtsc() {
-  uint64_t hi, lo;
-  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
-  return ((uint64_t)lo) | (((uint64_t)hi) << 32);
-}
+/// What an indirect call through a table looks like, as _lowercase_simd
+static void (*fn_ptr)() = f;
 
-/// compute the time added by the sequence
-/// a = RDTSC()
-/// fences()
-/// fences()
-/// b = RDTSC()
-///
-/// ~40 cycles on my machine (due to fences?!)
-void compute_bias() {
-  size_t RETRY = 10'000'000;
-  printf("computing bias and timings\n");
-
-  struct timespec tstart = {0, 0}, tend = {0, 0};
-  clock_gettime(CLOCK_MONOTONIC, &tstart);
-  uint64_t rstart = rdtsc();
-  {
-    uint64_t sum = 0;
-    for (size_t i = 0; i < RETRY; i++) {
-      uint64_t begining = rdtsc();
-      fences();
-      fences();
-      uint64_t end = rdtsc();
-
-      sum += end - begining;
-    }
-    float cycle_per_call = (float)sum / (float)RETRY;
-    bias = (uint64_t)cycle_per_call;
-  }
+struct base {
+  virtual void call() = 0;
+  virtual ~base() = default;
+};
+
+struct derived : base {
+  NO_INLINE void call() override { blackbox(); }
+};
 
-  // Is order optimal ?!
-  clock_gettime(CLOCK_MONOTONIC, &tend);
-  uint64_t rend = rdtsc();
+/// Hides the value of p from the compiler, so that it can't inline or
+/// devirtualize through it
+template <class T> inline T launder(T p) {
+  asm volatile("" : "+r"(p));
+  return p;
+}
 
-  assert(tstart.tv_sec == tend.tv_sec);
-  nano_per_cycle =
-      (float)(tend.tv_nsec - tstart.tv_nsec) / (float)(rend - rstart);
+template <size_t N, class F>
+[[gnu::always_inline]] inline void unrolled(F call) {
+  [&]<size_t... I>(std::index_sequence<I...>) {
+    (((void)I, call()), ...);
+  }(std::make_index_sequence<N>{});
+}
 
-  printf("Biais: %lu, nano per sec %f\n", bias, nano_per_cycle);
+template <size_t N> NO_INLINE void empty_loop() {
+  size_t n = launder(N);
+  for (size_t i = 0; i < n; i++) {
+    blackbox();
+  }
 }
 
-template <class F, class... Args>
-void bench(const char *name, size_t retry, F f, Args... args) {
-  printf("Bench %s\n", name);
+template <size_t N> NO_INLINE void inline_calls() {
+  unrolled<N>([]() { g(); });
+}
 
-  float mean = 0;
-  float var = 0;
+template <size_t N> NO_INLINE void noinline_calls() {
+  unrolled<N>([]() { f(); });
+}
 
-  for (size_t i = 1; i < retry + 1; i++) {
-    uint64_t begining = rdtsc();
-    fences();
-    f(args...);
-    fences();
-    uint64_t end = rdtsc();
+template <size_t N> NO_INLINE void pointer_calls() {
+  auto p = launder(fn_ptr);
+  unrolled<N>([p]() { p(); });
+}
 
-    uint64_t dr = end - begining;
-    float x = (float)dr - (float)bias;
+template <size_t N> NO_INLINE void virtual_calls(base *b) {
+  b = launder(b);
+  unrolled<N>([b]() { b->call(); });
+}
 
-    float delta1 = x - mean;
-    mean += (x - mean) / (float)i;
-    float delta2 = x - mean;
-    var = (float)(i * (i - 1)) * var + delta1 * delta2;
+/// Set by the setup of every block of the sweep, read by the timed calls
+static size_t batch = 1;
+
+/// Calls f.operator()<N>() for the current batch, the switch is well
+/// predicted and costs the same to every variant
+template <class F> [[gnu::always_inline]] inline void on_batch(F f) {
+  switch (batch) {
+  case 1:
+    return f.template operator()<1>();
+  case 8:
+    return f.template operator()<8>();
+  case 64:
+    return f.template operator()<64>();
+  default:
+    assert(batch == 512);
+    return f.template operator()<512>();
   }
+}
 
-  float nanos = mean * nano_per_cycle;
+static derived d;
 
-  printf("Took %.2f cycles or %.1f ns, var = %.f", mean, nanos, var);
-}
+/// Synthetic samples through mann_whitney and a sweep csv round trip, so
+/// that compare() is known to flag a regression, and only that
+void test_sweep() {
+  std::vector<float> low, high;
+  for (int i = 0; i < 10; i++) {
+    low.push_back(100.0f + (float)(i % 3));
+    high.push_back(120.0f + (float)(i % 4));
+  }
+  assert(mann_whitney(low, low) > 0.5);
+  assert(mann_whitney(low, high) < 0.001);
+  assert(mann_whitney(high, low) < 0.001);
+
+  char baseline[] = "/tmp/perf_baseline_XXXXXX";
+  char current[] = "/tmp/perf_current_XXXXXX";
+  close(mkstemp(baseline));
+  close(mkstemp(current));
+
+  // The writer: every variant, point and repeat, keyed "variant;<axes>"
+  sweep s("test");
+  s.axis("n", {1, 2}).variant("a", [](const sweep_point &) { blackbox(); });
+  s.variant("b", [](const sweep_point &) { blackbox(); });
+  s.repeats = 3;
+  s.retry = 10;
+  s.warmup = 1;
+  s.run(current);
+  auto loaded = sweep::load(current);
+  assert(loaded.size() == 4);
+  for (const char *key : {"a;1", "a;2", "b;1", "b;2"}) {
+    assert(loaded[key].size() == 3);
+  }
 
-NO_INLINE void f() { blackbox(); }
+  // Against the same run, then a slower one and a faster one
+  FILE *f = fopen(baseline, "w");
+  FILE *g = fopen(current, "w");
+  for (FILE *out : {f, g}) {
+    fprintf(out, "sweep;variant;n;repeat;cycles;ns;p50;p99\n");
+  }
+  for (int i = 0; i < 10; i++) {
+    fprintf(f, "test;same;1;%d;%f;0;0;0\n", i, low[i]);
+    fprintf(g, "test;same;1;%d;%f;0;0;0\n", i, low[i]);
+    fprintf(f, "test;slower;1;%d;%f;0;0;0\n", i, low[i]);
+    fprintf(g, "test;slower;1;%d;%f;0;0;0\n", i, high[i]);
+    fprintf(f, "test;faster;1;%d;%f;0;0;0\n", i, high[i]);
+    fprintf(g, "test;faster;1;%d;%f;0;0;0\n", i, low[i]);
+  }
+  fclose(f);
+  fclose(g);
+  assert(sweep::compare(current, baseline) == 1);
+  assert(sweep::compare(current, current) == 0);
+  assert(sweep::compare(current, "/nonexistent") == 0);
+
+  unlink(baseline);
+  unlink(current);
+  printf("Sweep comparison seems to work!\n");
+}
 
-int main() {
+/// ./bench [baseline.csv]: out.csv has the cycles of a whole batch, one line
+/// per repeat, and the cost per call is printed; with a baseline (a previous
+/// out.csv), the calls that got slower are reported and the exit status is 1
+int main(int argc, char *argv[]) {
+  setup_monothreaded();
   compute_bias();
-  bench("call", 1'000, f);
+  enable_perf_counters();
+  test_sweep();
+
+  sweep s("calls");
+  s.axis("batch", {1, 8, 64, 512});
+  s.setup([](const sweep_point &p) { batch = p["batch"]; });
+  s.variant("empty loop", [](const sweep_point &) {
+    on_batch([]<size_t N>() { empty_loop<N>(); });
+  });
+  s.variant("inline call", [](const sweep_point &) {
+    on_batch([]<size_t N>() { inline_calls<N>(); });
+  });
+  s.variant("noinline call", [](const sweep_point &) {
+    on_batch([]<size_t N>() { noinline_calls<N>(); });
+  });
+  s.variant("function pointer", [](const sweep_point &) {
+    on_batch([]<size_t N>() { pointer_calls<N>(); });
+  });
+  s.variant("virtual call", [](const sweep_point &) {
+    on_batch([]<size_t N>() { virtual_calls<N>(&d); });
+  });
+  s.run("out.csv");
+
+  // Per call, from the slope of the medians between two batch sizes: what
+  // every batch pays once (the timing sequence, the call to the batch, the
+  // switch) cancels out. Clamped at 0, as the noise can make it negative
+  auto res = sweep::load("out.csv");
+  auto median = [&res](const std::string &variant, size_t n) {
+    auto &cycles = res[variant + ";" + std::to_string(n)];
+    std::sort(cycles.begin(), cycles.end());
+    return cycles[cycles.size() / 2];
+  };
+  const auto &batches = s.axis_values[0];
+  for (auto &variant : s.variants) {
+    for (size_t b = 1; b < batches.size(); b++) {
+      size_t n1 = batches[b - 1], n2 = batches[b];
+      float per_call = (median(variant, n2) - median(variant, n1)) /
+                       (float)(n2 - n1);
+      per_call = per_call > 0 ? per_call : 0;
+      printf("%s x%zu..x%zu: %.2f cycles or %.2f ns per call\n",
+             variant.c_str(), n1, n2, per_call, per_call * nano_per_cycle);
+    }
+  }
+
+  if (argc > 1) {
+    return sweep::compare("out.csv", argv[1]) == 0 ? 0 : 1;
+  }
+  return 0;
 }